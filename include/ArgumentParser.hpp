@@ -15,6 +15,17 @@ public:
   std::string configFile;
   bool createHistograms = false;
   bool saveClusters = false;
+  bool stagedInput = false;
+  long maxMemory = 0;
+  std::string layout;
+  bool shardByRun = false;
+  int maxOpenRuns = 16;
+  bool asyncWrite = false;
+  int imtThreads = 0;
+  std::string catalogFile;
+  std::string originalFilelist;
+  std::string serveDir;
+  int idleTimeout = 600;
 
   void displayHelp() {
     std::cout << "./converter [args]" << std::endl;
@@ -23,6 +34,17 @@ public:
     std::cout << "\t--config-file=<file>, -c <file>     : YAML files with cuts to be done to the converted data" << std::endl;
     std::cout << "\t--create-histograms                 : Create histograms from the converted data" << std::endl;
     std::cout << "\t--save-clusters                     : Save clusters" << std::endl;
+    std::cout << "\t--max-memory=<MB>                   : Memory budget; DFs estimated to exceed it are converted in chunks of collisions (default: no limit)" << std::endl;
+    std::cout << "\t--layout=<vector|flat>              : Store tracks and clusters as std::vector branches or as counted arrays (default: from the config, else vector)" << std::endl;
+    std::cout << "\t--shard-by-run                      : Write one output per run, <dir>/run_<run>/<name> for an output <dir>/<name>" << std::endl;
+    std::cout << "\t--max-open-runs=<n>                 : Runs with an open output when sharding; the least recently written is closed beyond that (default: 16)" << std::endl;
+    std::cout << "\t--async-write                       : Fill and write the output tree on a separate thread, overlapped with the conversion" << std::endl;
+    std::cout << "\t--imt=<n>                           : Compress the output baskets with <n> ROOT implicit multithreading threads (default: 0, off)" << std::endl;
+    std::cout << "\t--catalog=<file>                    : Catalog written by ao2dcatalog; skip the unusable files and DFs it lists and size the buffers from it" << std::endl;
+    std::cout << "\t--serve=<dir>                       : Run as a service converting the requests spooled in <dir>, see scripts/converter_client.sh" << std::endl;
+    std::cout << "\t--idle-timeout=<s>                  : Stop serving after <s> seconds without requests, 0 to never stop (default: 600)" << std::endl;
+    std::cout << "\t--staged-input                      : Input files are being staged to local disk by the job script; wait for each one and delete it once converted" << std::endl;
+    std::cout << "\t--original-filelist=<file>          : List the staged input list was made from, line by line, under which the files are looked up in the catalog" << std::endl;
   }
 
   void reportError(std::string error) {
@@ -82,6 +104,68 @@ public:
         createHistograms = true;
       } else if (!arg.compare("--save-clusters")) {
         saveClusters = true;
+      } else if (!arg.compare("--max-memory")) {
+        if (++iter == canonical_args.end())
+          reportError("No memory budget after --max-memory directive");
+        try {
+          maxMemory = std::stol(*iter);
+        } catch (const std::exception &) {
+          reportError("Invalid memory budget: " + *iter);
+        }
+        if (maxMemory <= 0)
+          reportError("Memory budget must be positive: " + *iter);
+      } else if (!arg.compare("--layout")) {
+        if (++iter == canonical_args.end())
+          reportError("No layout after --layout directive");
+        layout = *iter;
+        if (layout != "vector" && layout != "flat")
+          reportError("Unknown layout: " + layout);
+      } else if (!arg.compare("--shard-by-run")) {
+        shardByRun = true;
+      } else if (!arg.compare("--max-open-runs")) {
+        if (++iter == canonical_args.end())
+          reportError("No number after --max-open-runs directive");
+        try {
+          maxOpenRuns = std::stoi(*iter);
+        } catch (const std::exception &) {
+          reportError("Invalid number of open runs: " + *iter);
+        }
+        if (maxOpenRuns <= 0)
+          reportError("Number of open runs must be positive: " + *iter);
+      } else if (!arg.compare("--async-write")) {
+        asyncWrite = true;
+      } else if (!arg.compare("--imt")) {
+        if (++iter == canonical_args.end())
+          reportError("No number of threads after --imt directive");
+        try {
+          imtThreads = std::stoi(*iter);
+        } catch (const std::exception &) {
+          reportError("Invalid number of threads: " + *iter);
+        }
+        if (imtThreads < 0)
+          reportError("Number of threads must not be negative: " + *iter);
+      } else if (!arg.compare("--catalog")) {
+        if (++iter == canonical_args.end())
+          reportError("No catalog after --catalog directive");
+        catalogFile = *iter;
+      } else if (!arg.compare("--serve")) {
+        if (++iter == canonical_args.end())
+          reportError("No spool directory after --serve directive");
+        serveDir = *iter;
+      } else if (!arg.compare("--idle-timeout")) {
+        if (++iter == canonical_args.end())
+          reportError("No timeout after --idle-timeout directive");
+        try {
+          idleTimeout = std::stoi(*iter);
+        } catch (const std::exception &) {
+          reportError("Invalid idle timeout: " + *iter);
+        }
+      } else if (!arg.compare("--staged-input")) {
+        stagedInput = true;
+      } else if (!arg.compare("--original-filelist")) {
+        if (++iter == canonical_args.end())
+          reportError("No file list after --original-filelist directive");
+        originalFilelist = *iter;
       } else if (iter->compare(0, 2, "-v") == 0) {
         ; // verbosity already parsed but avoid error
       } else if (!arg.compare("-h") || !arg.compare("--help")) {
@@ -93,7 +177,7 @@ public:
     }
 
     logInfo("Verbosity level: ", getSeverity());
-    if (inputFilelist.empty()) {
+    if (inputFilelist.empty() && serveDir.empty()) {
       reportError("Input file list is not provided");
     }
   }
@@ -0,0 +1,275 @@
+#ifndef ASYNC_WRITER_HPP
+#define ASYNC_WRITER_HPP
+
+#include "logger.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <Rtypes.h>
+
+// columns of the output, as (block member, output buffer)
+#define EVENT_COLUMNS_DO(defScalar)                               \
+  defScalar(Int_t,     runNumber,    fBuffer_runNumber)           \
+  defScalar(Float_t,   multiplicity, fBuffer_multiplicity)        \
+  defScalar(Float_t,   centrality,   fBuffer_centrality)          \
+  defScalar(Int_t,     occupancy,    fBuffer_trackOccupancyInTimeRange) \
+  defScalar(Float_t,   vtxZ,         fBuffer_vtxZ)                \
+  defScalar(UShort_t,  eventSel,     fBuffer_eventSel)            \
+  defScalar(ULong64_t, triggerSel,   fBuffer_triggerSel)          \
+  defScalar(UInt_t,    rct,          fBuffer_rct)
+
+#define TRACK_COLUMNS_DO(defArray)                                \
+  defArray(Float_t, track_pt,  fBuffer_track_pt)                  \
+  defArray(Float_t, track_eta, fBuffer_track_eta)                 \
+  defArray(Float_t, track_phi, fBuffer_track_phi)                 \
+  defArray(UChar_t, track_sel, fBuffer_track_sel)
+
+#define CLUSTER_COLUMNS_DO(defArray)                                          \
+  defArray(Float_t, cluster_energy,    fBuffer_cluster_energy)                \
+  defArray(Float_t, cluster_eta,       fBuffer_cluster_eta)                   \
+  defArray(Float_t, cluster_phi,       fBuffer_cluster_phi)                   \
+  defArray(Float_t, cluster_m02,       fBuffer_cluster_m02)                   \
+  defArray(Float_t, cluster_m20,       fBuffer_cluster_m20)                   \
+  defArray(Int_t,   cluster_ncells,    fBuffer_cluster_ncells)                \
+  defArray(Float_t, cluster_time,      fBuffer_cluster_time)                  \
+  defArray(UChar_t, cluster_exoticity, fBuffer_cluster_isExotic)              \
+  defArray(Float_t, cluster_dbc,       fBuffer_cluster_distanceToBadChannel)  \
+  defArray(Int_t,   cluster_nlm,       fBuffer_cluster_nlm)                   \
+  defArray(Int_t,   cluster_defn,      fBuffer_cluster_definition)            \
+  defArray(Int_t,   cluster_matched_track_n, fBuffer_cluster_matchedTrackN)
+
+#define MATCHED_COLUMNS_DO(defArray)                                                    \
+  defArray(Float_t, cluster_matched_track_delta_eta, fBuffer_cluster_matchedTrackDeltaEta) \
+  defArray(Float_t, cluster_matched_track_delta_phi, fBuffer_cluster_matchedTrackDeltaPhi) \
+  defArray(Float_t, cluster_matched_track_p,         fBuffer_cluster_matchedTrackP)        \
+  defArray(Float_t, cluster_matched_track_pt,        fBuffer_cluster_matchedTrackPt)       \
+  defArray(UChar_t, cluster_matched_track_sel,       fBuffer_cluster_matchedTrackSel)
+
+// Selected events in columns: one entry per event for the event properties, and the
+// tracks, clusters and matched tracks of all events back to back, delimited by the
+// per-event end offsets.
+struct EventBlock {
+#define BLOCK_SCALAR(type, name, buffer) std::vector<type> name;
+#define BLOCK_ARRAY(type, name, buffer) std::vector<type> name;
+  EVENT_COLUMNS_DO(BLOCK_SCALAR)
+  TRACK_COLUMNS_DO(BLOCK_ARRAY)
+  CLUSTER_COLUMNS_DO(BLOCK_ARRAY)
+  MATCHED_COLUMNS_DO(BLOCK_ARRAY)
+#undef BLOCK_SCALAR
+#undef BLOCK_ARRAY
+  std::vector<size_t> trackEnd, clusterEnd, matchedEnd;
+
+  size_t size() const { return runNumber.size(); }
+
+  // first track, cluster and matched track of an event
+  size_t trackBegin(size_t event) const { return event ? trackEnd[event - 1] : 0; }
+  size_t clusterBegin(size_t event) const { return event ? clusterEnd[event - 1] : 0; }
+  size_t matchedBegin(size_t event) const { return event ? matchedEnd[event - 1] : 0; }
+
+  void clear() {
+#define BLOCK_CLEAR(type, name, buffer) name.clear();
+    EVENT_COLUMNS_DO(BLOCK_CLEAR)
+    TRACK_COLUMNS_DO(BLOCK_CLEAR)
+    CLUSTER_COLUMNS_DO(BLOCK_CLEAR)
+    MATCHED_COLUMNS_DO(BLOCK_CLEAR)
+#undef BLOCK_CLEAR
+    trackEnd.clear();
+    clusterEnd.clear();
+    matchedEnd.clear();
+  }
+
+  // size the columns for the expected contents, so filling does not reallocate
+  void reserve(size_t events, size_t tracks, size_t clusters, size_t matched) {
+#define BLOCK_RESERVE(type, name, buffer) name.reserve(events);
+    EVENT_COLUMNS_DO(BLOCK_RESERVE)
+#undef BLOCK_RESERVE
+#define BLOCK_RESERVE(type, name, buffer) name.reserve(tracks);
+    TRACK_COLUMNS_DO(BLOCK_RESERVE)
+#undef BLOCK_RESERVE
+#define BLOCK_RESERVE(type, name, buffer) name.reserve(clusters);
+    CLUSTER_COLUMNS_DO(BLOCK_RESERVE)
+#undef BLOCK_RESERVE
+#define BLOCK_RESERVE(type, name, buffer) name.reserve(matched);
+    MATCHED_COLUMNS_DO(BLOCK_RESERVE)
+#undef BLOCK_RESERVE
+    trackEnd.reserve(events);
+    clusterEnd.reserve(events);
+    matchedEnd.reserve(events);
+  }
+
+  // close the event whose objects were appended since the previous one
+  void endEvent() {
+    trackEnd.push_back(track_pt.size());
+    clusterEnd.push_back(cluster_energy.size());
+    matchedEnd.push_back(cluster_matched_track_delta_eta.size());
+  }
+};
+
+// Lock-free queue between exactly one producer and one consumer thread.
+template<class T, size_t N>
+class SpscQueue {
+  T slots[N];
+  std::atomic<size_t> head{0}; // next slot to pop, written by the consumer
+  std::atomic<size_t> tail{0}; // next slot to push, written by the producer
+
+public:
+  bool push(const T &value) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) return false;
+    slots[t % N] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &value) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    value = slots[h % N];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+};
+
+// time spent by each side, reported at the end of the conversion
+struct WriterStats {
+  double busySeconds = 0;    // writer filling the tree
+  double idleSeconds = 0;    // writer waiting for blocks
+  double stallSeconds = 0;   // conversion waiting for the writer to free a block
+  long blocks = 0;
+};
+
+// Writes event blocks on a dedicated thread while the conversion thread builds the next
+// ones. Two blocks circulate: the conversion thread fills one while the writer writes
+// the other, and they are exchanged over two lock-free queues, so neither side takes a
+// lock on the way.
+class AsyncWriter {
+  static constexpr size_t kBlocks = 2;
+  using Write = std::function<void(EventBlock &)>;
+
+  Write write;
+  EventBlock blocks[kBlocks];
+  SpscQueue<EventBlock *, kBlocks> full, spare;
+  EventBlock *current = nullptr;
+  std::atomic<bool> stopping{false};
+  std::atomic<size_t> inFlight{0};
+  std::exception_ptr error;
+  std::atomic<bool> failed{false};
+  std::thread thread;
+  WriterStats stats;
+
+  using clock = std::chrono::steady_clock;
+
+  static double seconds(clock::time_point since) {
+    return std::chrono::duration<double>(clock::now() - since).count();
+  }
+
+  // spin briefly, then back off, so a waiting side neither burns a core nor adds latency
+  static void pause(int &spins) {
+    if (++spins < 64)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+
+  void run() {
+    EventBlock *block;
+    while (true) {
+      auto waitStart = clock::now();
+      int spins = 0;
+      while (!full.pop(block)) {
+        if (stopping.load(std::memory_order_acquire) && full.empty()) {
+          stats.idleSeconds += seconds(waitStart);
+          return;
+        }
+        pause(spins);
+      }
+      stats.idleSeconds += seconds(waitStart);
+
+      auto writeStart = clock::now();
+      if (!error) {
+        try {
+          write(*block);
+        } catch (...) {
+          // reported on the conversion thread, the remaining blocks are dropped
+          error = std::current_exception();
+          failed.store(true, std::memory_order_release);
+        }
+      }
+      stats.busySeconds += seconds(writeStart);
+      stats.blocks++;
+      block->clear();
+      spare.push(block);
+      inFlight.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  void rethrow() {
+    if (failed.load(std::memory_order_acquire)) std::rethrow_exception(error);
+  }
+
+public:
+  explicit AsyncWriter(Write write) : write(write) {
+    for (auto &block : blocks) spare.push(&block);
+    thread = std::thread(&AsyncWriter::run, this);
+  }
+
+  ~AsyncWriter() {
+    stopping.store(true, std::memory_order_release);
+    if (thread.joinable()) thread.join();
+  }
+
+  // block being filled by the conversion thread, waits for the writer to free one
+  EventBlock &block() {
+    rethrow();
+    if (!current) {
+      auto waitStart = clock::now();
+      int spins = 0;
+      while (!spare.pop(current)) pause(spins);
+      stats.stallSeconds += seconds(waitStart);
+    }
+    return *current;
+  }
+
+  // size all blocks, before the first one is submitted
+  void reserve(size_t events, size_t tracks, size_t clusters, size_t matched) {
+    for (auto &b : blocks) b.reserve(events, tracks, clusters, matched);
+  }
+
+  // hand the current block over to the writer
+  void submit() {
+    if (!current || !current->size()) return;
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    full.push(current);
+    current = nullptr;
+  }
+
+  // wait until everything submitted is written; rethrows a failure of the writer
+  void flush() {
+    submit();
+    auto waitStart = clock::now();
+    int spins = 0;
+    while (inFlight.load(std::memory_order_acquire)) pause(spins);
+    stats.stallSeconds += seconds(waitStart);
+    rethrow();
+  }
+
+  // write everything submitted and stop the writer thread
+  void finish() {
+    flush();
+    stopping.store(true, std::memory_order_release);
+    if (thread.joinable()) thread.join();
+  }
+
+  // complete after finish
+  const WriterStats &getStats() const { return stats; }
+};
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef CATALOG_HPP
+#define CATALOG_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// tables of a DF recorded in the catalog, as (member, tree name)
+#define CATALOG_TABLES_DO(defTable)         \
+  defTable(bcs,           "O2jbc")           \
+  defTable(collisions,    "O2jcollision")    \
+  defTable(tracks,        "O2jtrack")        \
+  defTable(clusters,      "O2jcluster")      \
+  defTable(clusterTracks, "O2jclustertrack") \
+  defTable(emcTracks,     "O2jemctrack")
+
+// entries per table, -1 for a table that is not there
+struct CatalogCounts {
+#define CATALOG_MEMBER(member, tree) int64_t member = -1;
+  CATALOG_TABLES_DO(CATALOG_MEMBER)
+#undef CATALOG_MEMBER
+
+  void add(const CatalogCounts &other) {
+#define CATALOG_ADD(member, tree) \
+  if (other.member >= 0) member = (member < 0 ? 0 : member) + other.member;
+    CATALOG_TABLES_DO(CATALOG_ADD)
+#undef CATALOG_ADD
+  }
+
+  // the tables read by the converter are there
+  bool complete(bool clusters) const {
+    return bcs >= 0 && collisions >= 0 && tracks >= 0 &&
+           (!clusters || (this->clusters >= 0 && clusterTracks >= 0 && emcTracks >= 0));
+  }
+};
+
+// Status of a file or DF:
+//   ok           readable, all tables read by the converter without clusters are there
+//   incomplete   a DF misses O2jbc, O2jcollision or O2jtrack
+//   unreadable   reading a DF failed (with --deep, any basket of it)
+//   recovered    the file was not closed properly and ROOT recovered its keys
+//   zombie       the file could not be opened
+//   missing      the file does not exist
+struct CatalogDF {
+  std::string name;
+  std::string status = "ok";
+  int64_t bytes = 0; // compressed size of the tables
+  std::vector<int> runs;
+  CatalogCounts counts;
+
+  bool usable(bool clusters) const { return status == "ok" && counts.complete(clusters); }
+};
+
+struct CatalogFile {
+  std::string path;
+  std::string status = "ok";
+  int64_t bytes = 0; // file size
+  std::vector<CatalogDF> dfs;
+
+  bool usable(bool clusters) const {
+    if (status != "ok" && status != "recovered") return false;
+    for (auto &df : dfs)
+      if (df.usable(clusters)) return true;
+    return false;
+  }
+
+  const CatalogDF *df(const std::string &name) const {
+    for (auto &d : dfs)
+      if (d.name == name) return &d;
+    return nullptr;
+  }
+};
+
+// Per-DF metadata of a list of AO2Ds, written by bin/ao2dcatalog and read by the converter
+// (--catalog) and the scheduler. Stored as a tab-separated file with one line per file,
+// with "-" as DF name, followed by one line per DF:
+//   path  df  status  bytes  runs  O2jbc  O2jcollision  O2jtrack  O2jcluster  O2jclustertrack  O2jemctrack
+class Catalog {
+  std::vector<CatalogFile> files;
+  std::map<std::string, size_t> index;
+
+  static std::string count(int64_t n) { return n < 0 ? "-" : std::to_string(n); }
+  static int64_t count(const std::string &s) { return s == "-" ? -1 : std::stoll(s); }
+
+  static std::string joinRuns(const std::vector<int> &runs) {
+    std::string s;
+    for (int run : runs) s += (s.empty() ? "" : ",") + std::to_string(run);
+    return s.empty() ? "-" : s;
+  }
+
+  static std::vector<int> splitRuns(const std::string &s) {
+    std::vector<int> runs;
+    if (s == "-") return runs;
+    std::stringstream ss(s);
+    for (std::string run; std::getline(ss, run, ',');) runs.push_back(std::stoi(run));
+    return runs;
+  }
+
+  static std::string line(const std::string &path, const std::string &df, const std::string &status, int64_t bytes,
+                          const std::vector<int> &runs, const CatalogCounts &counts) {
+    std::string l = path + "\t" + df + "\t" + status + "\t" + std::to_string(bytes) + "\t" + joinRuns(runs);
+#define CATALOG_WRITE(member, tree) l += "\t" + count(counts.member);
+    CATALOG_TABLES_DO(CATALOG_WRITE)
+#undef CATALOG_WRITE
+    return l;
+  }
+
+public:
+  void add(CatalogFile file) {
+    index[file.path] = files.size();
+    files.push_back(std::move(file));
+  }
+
+  const std::vector<CatalogFile> &getFiles() const { return files; }
+
+  const CatalogFile *find(const std::string &path) const {
+    auto it = index.find(path);
+    return it == index.end() ? nullptr : &files[it->second];
+  }
+
+  // entries of all usable DFs
+  CatalogCounts totals(bool clusters) const {
+    CatalogCounts sum;
+    for (auto &file : files) {
+      if (!file.usable(clusters)) continue;
+      for (auto &df : file.dfs)
+        if (df.usable(clusters)) sum.add(df.counts);
+    }
+    return sum;
+  }
+
+  void write(const std::string &filename) const {
+    std::ofstream out(filename);
+    if (!out.is_open()) throw std::runtime_error("Catalog " + filename + " could not be written");
+    out << "#path\tdf\tstatus\tbytes\truns";
+#define CATALOG_HEADER(member, tree) out << "\t" << tree;
+    CATALOG_TABLES_DO(CATALOG_HEADER)
+#undef CATALOG_HEADER
+    out << "\n";
+    for (auto &file : files) {
+      // the file line holds the runs and entries of all its DFs
+      CatalogCounts counts;
+      std::vector<int> runs;
+      for (auto &df : file.dfs) {
+        counts.add(df.counts);
+        for (int run : df.runs)
+          if (std::find(runs.begin(), runs.end(), run) == runs.end()) runs.push_back(run);
+      }
+      out << line(file.path, "-", file.status, file.bytes, runs, counts) << "\n";
+      for (auto &df : file.dfs) out << line(file.path, df.name, df.status, df.bytes, df.runs, df.counts) << "\n";
+    }
+  }
+
+  static Catalog read(const std::string &filename) {
+    std::ifstream in(filename);
+    if (!in.is_open()) throw std::runtime_error("Catalog " + filename + " could not be read");
+    Catalog catalog;
+    CatalogFile *current = nullptr;
+    std::string l;
+    int lineNumber = 0;
+    while (std::getline(in, l)) {
+      lineNumber++;
+      if (l.empty() || l[0] == '#') continue;
+      std::vector<std::string> fields;
+      std::stringstream ss(l);
+      for (std::string field; std::getline(ss, field, '\t');) fields.push_back(field);
+      if (fields.size() != 11)
+        throw std::runtime_error("Catalog " + filename + ", line " + std::to_string(lineNumber) + ": expected 11 columns");
+
+      if (fields[1] == "-") {
+        CatalogFile file;
+        file.path = fields[0];
+        file.status = fields[2];
+        file.bytes = std::stoll(fields[3]);
+        catalog.add(file);
+        current = &catalog.files.back();
+        continue;
+      }
+      if (!current || current->path != fields[0])
+        throw std::runtime_error("Catalog " + filename + ", line " + std::to_string(lineNumber) + ": DF before its file");
+      CatalogDF df;
+      df.name = fields[1];
+      df.status = fields[2];
+      df.bytes = std::stoll(fields[3]);
+      df.runs = splitRuns(fields[4]);
+      size_t column = 5;
+#define CATALOG_READ(member, tree) df.counts.member = count(fields[column++]);
+      CATALOG_TABLES_DO(CATALOG_READ)
+#undef CATALOG_READ
+      current->dfs.push_back(df);
+    }
+    return catalog;
+  }
+};
+
+#endif
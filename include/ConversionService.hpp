@@ -0,0 +1,198 @@
+#ifndef CONVERSION_SERVICE_HPP
+#define CONVERSION_SERVICE_HPP
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <yaml-cpp/yaml.h>
+
+// one conversion submitted to the service, see scripts/converter_client.sh
+struct ConversionRequest {
+  std::string id;
+  std::string inputFilelist;
+  std::string outputFilename;
+  std::string configFile;
+  bool createHistograms = false;
+  bool saveClusters = false;
+  bool stagedInput = false;
+  long maxMemory = 0;
+  std::string layout;
+  bool shardByRun = false;
+  int maxOpenRuns = 16;
+  bool asyncWrite = false;
+  int imtThreads = 0;
+  std::string catalog;
+  std::string originalFilelist;
+};
+
+// Long-lived converter serving requests from a spool directory, so that ROOT, its
+// class information and the parsed configs stay warm between conversions.
+//
+// A client writes <spool>/incoming/<id>.yaml (via a rename, so it is never seen half
+// written). The service claims it by moving it to active/, converts, and answers in
+// done/<id>.yaml with the status and the conversion totals. The service holds a lock
+// on <spool>/server.lock while it runs, which clients use to tell whether it is alive.
+// Requests are served one at a time, oldest first, so concurrent clients queue in the
+// spool directory. Once <spool>/drain appears, it serves the requests already submitted
+// and exits.
+class ConversionService {
+  using Handler = std::function<YAML::Node(const ConversionRequest &, const YAML::Node &)>;
+
+  std::filesystem::path spool;
+  int idleTimeout;
+  int lockFd = -1;
+
+  // parsed configs by path, reparsed when the file changes
+  std::map<std::string, std::pair<std::filesystem::file_time_type, YAML::Node>> configs;
+
+  const YAML::Node &getConfig(const std::string &path) {
+    auto mtime = std::filesystem::last_write_time(path);
+    auto it = configs.find(path);
+    if (it == configs.end() || it->second.first != mtime) {
+      logInfo("Loading config: ", path);
+      configs[path] = {mtime, YAML::LoadFile(path)};
+    }
+    return configs[path].second;
+  }
+
+  static ConversionRequest parseRequest(const std::string &id, const YAML::Node &node) {
+    ConversionRequest req;
+    req.id = id;
+    if (!node["input"] || !node["output"] || !node["config"])
+      throw std::runtime_error("Request needs input, output and config");
+    req.inputFilelist = node["input"].as<std::string>();
+    req.outputFilename = node["output"].as<std::string>();
+    req.configFile = node["config"].as<std::string>();
+    if (node["create_histograms"]) req.createHistograms = node["create_histograms"].as<bool>();
+    if (node["save_clusters"]) req.saveClusters = node["save_clusters"].as<bool>();
+    if (node["staged_input"]) req.stagedInput = node["staged_input"].as<bool>();
+    if (node["max_memory"]) req.maxMemory = node["max_memory"].as<long>();
+    if (node["layout"]) req.layout = node["layout"].as<std::string>();
+    if (node["shard_by_run"]) req.shardByRun = node["shard_by_run"].as<bool>();
+    if (node["max_open_runs"]) req.maxOpenRuns = node["max_open_runs"].as<int>();
+    if (node["async_write"]) req.asyncWrite = node["async_write"].as<bool>();
+    if (node["imt"]) req.imtThreads = node["imt"].as<int>();
+    if (node["catalog"]) req.catalog = node["catalog"].as<std::string>();
+    if (node["original_filelist"]) req.originalFilelist = node["original_filelist"].as<std::string>();
+    return req;
+  }
+
+  void reply(const std::string &id, YAML::Node answer) {
+    std::filesystem::path tmp = spool / "done" / (id + ".tmp");
+    {
+      std::ofstream out(tmp);
+      out << answer << std::endl;
+    }
+    std::filesystem::rename(tmp, spool / "done" / (id + ".yaml"));
+  }
+
+  // oldest pending request, if any
+  bool nextRequest(std::filesystem::path &request) {
+    std::vector<std::filesystem::path> pending;
+    for (auto &entry : std::filesystem::directory_iterator(spool / "incoming"))
+      if (entry.path().extension() == ".yaml") pending.push_back(entry.path());
+    if (pending.empty()) return false;
+    std::sort(pending.begin(), pending.end(), [](const auto &a, const auto &b) {
+      return std::filesystem::last_write_time(a) < std::filesystem::last_write_time(b);
+    });
+    request = pending.front();
+    return true;
+  }
+
+  void serve(const std::filesystem::path &request, const Handler &handler) {
+    std::string id = request.stem().string();
+    std::filesystem::path active = spool / "active" / request.filename();
+    std::error_code ec;
+    std::filesystem::rename(request, active, ec);
+    if (ec) return; // claimed by someone else
+    logInfo("Serving request ", id);
+
+    auto start = std::chrono::steady_clock::now();
+    YAML::Node answer;
+    try {
+      ConversionRequest req = parseRequest(id, YAML::LoadFile(active.string()));
+      answer = handler(req, getConfig(req.configFile));
+      answer["status"] = "ok";
+    } catch (const std::exception &e) {
+      logError("Request ", id, " failed: ", e.what());
+      answer["status"] = "error";
+      answer["message"] = e.what();
+    }
+    answer["seconds"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    reply(id, answer);
+    std::filesystem::remove(active);
+    logInfo("Request ", id, " finished: ", answer["status"].as<std::string>());
+  }
+
+public:
+  ConversionService(const std::string &spoolDir, int idleTimeout) : spool(spoolDir), idleTimeout(idleTimeout) {
+    for (const char *sub : {"incoming", "active", "done"})
+      std::filesystem::create_directories(spool / sub);
+  }
+
+  ~ConversionService() {
+    if (lockFd >= 0) close(lockFd);
+  }
+
+  // serve requests until idle for idleTimeout seconds, until <spool>/shutdown appears or
+  // until <spool>/drain appears and no request is left; returns nonzero if another service already owns the spool directory
+  int run(const Handler &handler) {
+    std::string lockFile = (spool / "server.lock").string();
+    lockFd = open(lockFile.c_str(), O_RDWR | O_CREAT, 0644);
+    // clients checking whether a service is alive hold the lock for an instant
+    bool locked = false;
+    for (int attempt = 0; lockFd >= 0 && attempt < 10 && !(locked = flock(lockFd, LOCK_EX | LOCK_NB) == 0); attempt++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    if (!locked) {
+      logWarning("Another converter service is already serving ", spool.string());
+      return 1;
+    }
+    logInfo("Serving conversion requests from ", spool.string(), " (pid ", getpid(), ")");
+
+    // requests left active by a service that died are failed, their clients may already
+    // be converting them directly
+    for (auto &entry : std::filesystem::directory_iterator(spool / "active")) {
+      YAML::Node answer;
+      answer["status"] = "error";
+      answer["message"] = "interrupted by the end of a previous converter service";
+      reply(entry.path().stem().string(), answer);
+      std::filesystem::remove(entry.path());
+    }
+
+    auto lastActive = std::chrono::steady_clock::now();
+    while (!std::filesystem::exists(spool / "shutdown")) {
+      std::filesystem::path request;
+      if (nextRequest(request)) {
+        serve(request, handler);
+        lastActive = std::chrono::steady_clock::now();
+        continue;
+      }
+      if (std::filesystem::exists(spool / "drain")) {
+        logInfo("Drained, shutting down");
+        return 0;
+      }
+      if (idleTimeout > 0 && std::chrono::steady_clock::now() - lastActive > std::chrono::seconds(idleTimeout)) {
+        logInfo("No requests for ", idleTimeout, " s, shutting down");
+        return 0;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    logInfo("Shutdown requested");
+    return 0;
+  }
+};
+
+#endif
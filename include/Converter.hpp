@@ -10,48 +10,70 @@
 #include <TList.h>
 #include <TTree.h>
 
-#include <yaml-cpp/yaml.h>
+#include "OutputTree.hpp"
 
-#define HISTOGRAMS_DO(defH1, defH2)                                 \
-  /* TH1F */                                                        \
-  defH1(hTrackPt,       "Track p_{T}",      100, 0,   100)          \
-  defH1(hClusterEnergy, "Cluster Energy",   100, 0,   100)          \
-  defH1(hClusterEta,    "Cluster #eta",     100, -1,  1)            \
-  defH1(hClusterPhi,    "Cluster #phi",     100, 0,   2 * 3.14)     \
-  defH1(hNEvents,       "Number of events", 2,   0,   2)            \
-  defH1(hEvtVtxX,       "Event vertex x",   100, -10, 10)           \
-  defH1(hEvtVtxY,       "Event vertex y",   100, -10, 10)           \
-  defH1(hEvtVtxZ,       "Event vertex z",   100, -10, 10)           \
-  /* TH2F */                                                        \
-  defH2(hClusterM02vsE, "Cluster M02 vs E", 300, 0, 3, 100, 0, 100)
+#include <yaml-cpp/yaml.h>
 
 class TFile;
 
 class Event;
 
-class Converter {
+class HistogramManager;
+
+class SummaryManager;
+
+class RunShards;
+
+class AsyncWriter;
 
-#define DECLARE_HISTOGRAMS(name, title, nbins, xlop, xup) TH1F *name;
+struct EventBlock;
 
-#undef DECLARE_HISTOGRAMS
+class Catalog;
+
+struct CatalogFile;
+
+// totals reported at the end of a conversion
+struct ConversionStats {
+  long dataframes = 0;
+  long events = 0;
+  long written = 0;
+  double fillSeconds = 0;
+  long runs = 0;
+  long skippedFiles = 0;      // unusable according to the catalog
+  long skippedDataframes = 0; // unusable DFs of the converted files
+};
+
+class Converter {
 
+  // holds the tree, or only the QA histograms when sharding by run
   TFile *outFile;
 
-  // Histograms for QA purposes
+  // Histograms for QA purposes, filled while writing
   TList *outputhists;
+  HistogramManager *histograms;
 
-  TTree *outputTree;
+  OutputTree output;
 
-  TH1F *hTrackPt;
-  TH1F *hClusterEnergy;
-  TH1F *hClusterEta;
-  TH1F *hClusterPhi;
-  TH1F *hNEvents;
-  TH1F *hEvtVtxX;
-  TH1F *hEvtVtxY;
-  TH1F *hEvtVtxZ;
+  // optional per-run output files instead of the single tree
+  RunShards *shards;
 
-  TH2F *hClusterM02vsE;
+  // selected events are written in blocks, on a separate thread with asynchronous writing
+  AsyncWriter *writer;
+  EventBlock *block;
+  size_t eventsPerBlock;
+
+  // implicit multithreading turned on by this conversion
+  bool imtEnabled;
+
+  // flat layout: counters and leaf-list arrays instead of std::vector branches
+  bool flatLayout;
+  Int_t nTracks, nClusters, nMatched;
+  void bookFlatBranches(OutputTree &out);
+  void setFlatCounters(const EventBlock &block, size_t event);
+  void bindFlatBranches(OutputTree &out, EventBlock &block, size_t event);
+
+  // optional scalar per-event summaries of the written tracks and clusters
+  SummaryManager *summaries;
 
   // cuts for tree production
   YAML::Node treecuts;
@@ -69,41 +91,40 @@ class Converter {
   float cluster_E_min;
 
   void createQAHistos();
-  void createTree();
-
-  void writeEvents(TTree *tree, std::vector<Event> &events);
-
-  void doAnalysis(std::vector<Event> &events);
+  void allocateBuffers();
+  void bookTree(OutputTree &out);
 
-  void clearBuffers();
+  void writeEvents(std::vector<Event> &events);
+  void submitBlock();
+  void writeBlock(EventBlock &block);
 
   // define global switches
   bool createHistograms;
   bool saveClusters;
 
+  // memory budget for the events built from one DF, in bytes (0: no limit)
+  size_t maxMemory;
+  size_t eventMemory;
+  void setMemoryBudget(long maxMemoryMB);
+
+  ConversionStats stats;
+
 public:
-  void processFile(TFile *file);
-
-  Converter(TString outputFilename, TString configFile, bool createHistograms, bool saveClusters)
-      : createHistograms(createHistograms), saveClusters(saveClusters) {
-    outFile = new TFile(outputFilename.Data(), "RECREATE");
-
-    treecuts = YAML::LoadFile(configFile.Data());
-    readConfig();
-    if (createHistograms) {
-      createQAHistos();
-    }
-    createTree();
-  }
-
-  ~Converter() {
-    outFile->cd();
-    outputTree->Write("", TObject::kOverwrite);
-    if (createHistograms) {
-      outputhists->Write();
-    }
-    outFile->Close();
-  }
+  // with a catalog entry, the DFs it marks as unusable are skipped
+  void processFile(TFile *file, const CatalogFile *entry = nullptr);
+  // count a file left out because the catalog marks it as unusable
+  void skipFile(const CatalogFile &entry);
+  // size the event blocks from the average contents of the catalogued events
+  void presize(const Catalog &catalog);
+
+  // waits for the writer, so that the totals include everything converted so far
+  const ConversionStats &getStats();
+
+  Converter(TString outputFilename, const YAML::Node &config, bool createHistograms, bool saveClusters, long maxMemoryMB = 0,
+            std::string layout = "", bool shardByRun = false, int maxOpenRuns = 16, bool asyncWrite = false,
+            int imtThreads = 0);
+
+  ~Converter();
 };
 
 #endif
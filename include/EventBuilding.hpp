@@ -3,9 +3,13 @@
 
 #include "logger.hpp"
 
+#include <array>
 #include <unordered_map>
+#include <unordered_set>
 #include <cmath>
+#include <fstream>
 #include <tuple>
+#include <unistd.h>
 #include <TTreeReader.h>
 #include <TTreeReaderValue.h>
 #include <TTreeReaderArray.h>
@@ -182,26 +186,211 @@ public:
   std::vector<Cluster> clusters;
 };
 
+// rough in-memory cost of the objects built for one collision, track, cluster and
+// matched track, including their share of the lookup maps and allocator overhead
+constexpr size_t kCollisionCost    = 2 * (sizeof(Event) + 2 * sizeof(std::vector<int>) + 64);
+constexpr size_t kTrackCost        = 2 * (sizeof(Track) + sizeof(int));
+constexpr size_t kClusterCost      = 2 * (sizeof(Cluster) + sizeof(int));
+constexpr size_t kMatchedTrackCost = 2 * (4 * sizeof(Float_t) + sizeof(uint8_t) + 9 * sizeof(Float_t) + 64);
+
+// resident set size of this process in bytes
+inline size_t currentRSS() {
+  size_t pages = 0, resident = 0;
+  std::ifstream statm("/proc/self/statm");
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// range of collisions built in one go, with the track and cluster entries to scan for them
+struct CollisionChunk {
+  Long64_t colBegin, colEnd;
+  Long64_t trackBegin, trackEnd;
+  Long64_t clusterBegin, clusterEnd;
+};
+
+// entries of a table per collision, from its index column
+struct PerCollision {
+  std::vector<Long64_t> counts;
+  std::vector<Long64_t> first, last; // first and last entry of each collision, -1 if none
+  bool sorted = true;
+};
+
+// index the entries of a table by collision, reading only the index column; entries without
+// a valid collision (e.g. -1) are left out, and may sit anywhere in a sorted table
+PerCollision indexPerCollision(TTree *tree, Long64_t nCollisions) {
+  PerCollision index;
+  index.counts.assign(nCollisions, 0);
+  index.first.assign(nCollisions, -1);
+  index.last.assign(nCollisions, -1);
+  TBranch *branch = tree->GetBranch("fIndexJCollisions");
+  if (!branch) throw std::runtime_error("Branch 'fIndexJCollisions' in TTree " + std::string(tree->GetName()) + " not found");
+  int lastID = -1;
+  for (Long64_t j = 0; j < tree->GetEntries(); j++) {
+    branch->GetEntry(j);
+    int collisionID;
+    GetLeafValue(tree, "fIndexJCollisions", collisionID);
+    if (collisionID < 0 || collisionID >= nCollisions) continue;
+    if (collisionID < lastID) index.sorted = false;
+    lastID = collisionID;
+    index.counts[collisionID]++;
+    if (index.first[collisionID] < 0) index.first[collisionID] = j;
+    index.last[collisionID] = j;
+  }
+  return index;
+}
+
+// extend the entry range [begin, end) of a chunk of a sorted table to a collision's entries
+inline void extendRange(Long64_t &begin, Long64_t &end, const PerCollision &index, Long64_t idxCol) {
+  if (index.first[idxCol] < 0) return;
+  if (begin == end) begin = index.first[idxCol];
+  end = index.last[idxCol] + 1;
+}
+
+// split a DF into collision chunks whose estimated memory footprint fits in the budget (bytes);
+// a budget of zero builds the whole DF at once
+std::vector<CollisionChunk> planChunks(TTree *collisions, TTree *tracks, TTree *clusters,
+                                       TTree *emctracks, bool saveClusters, size_t budget) {
+  Long64_t nCollisions = collisions->GetEntries();
+  Long64_t nTracks = tracks->GetEntries();
+  Long64_t nClusters = saveClusters ? clusters->GetEntries() : 0;
+  CollisionChunk whole{0, nCollisions, 0, nTracks, 0, nClusters};
+  if (budget == 0) return {whole};
+
+  Long64_t nMatched = saveClusters ? emctracks->GetEntries() : 0;
+  double matchedPerCluster = nClusters ? (double)nMatched / nClusters : 0.;
+  double clusterCost = kClusterCost + matchedPerCluster * kMatchedTrackCost;
+  double estimate = nCollisions * kCollisionCost + nTracks * kTrackCost + nClusters * clusterCost;
+  if (estimate <= budget) {
+    logDebug("   Estimated DF size: ", estimate / (1 << 20), " MB");
+    return {whole};
+  }
+
+  PerCollision trackIndex = indexPerCollision(tracks, nCollisions);
+  PerCollision clusterIndex;
+  if (saveClusters) {
+    clusterIndex = indexPerCollision(clusters, nCollisions);
+  } else {
+    clusterIndex.counts.assign(nCollisions, 0);
+    clusterIndex.first.assign(nCollisions, -1);
+    clusterIndex.last.assign(nCollisions, -1);
+  }
+  bool tracksSorted = trackIndex.sorted, clustersSorted = clusterIndex.sorted;
+  // unsorted tables still work, at the price of scanning the whole table for every chunk
+  if (!tracksSorted) logWarning("   O2jtrack is not sorted by collision, scanning all tracks for every chunk");
+  if (!clustersSorted) logWarning("   O2jcluster is not sorted by collision, scanning all clusters for every chunk");
+
+  std::vector<CollisionChunk> chunks;
+  CollisionChunk chunk = whole;
+  chunk.colEnd = chunk.trackEnd = chunk.clusterEnd = 0;
+  double chunkCost = 0;
+  for (Long64_t idxCol = 0; idxCol < nCollisions; idxCol++) {
+    double colCost = kCollisionCost + trackIndex.counts[idxCol] * kTrackCost + clusterIndex.counts[idxCol] * clusterCost;
+    if (chunkCost > 0 && chunkCost + colCost > budget) {
+      chunks.push_back(chunk);
+      chunk = {idxCol, idxCol, chunk.trackEnd, chunk.trackEnd, chunk.clusterEnd, chunk.clusterEnd};
+      chunkCost = 0;
+    }
+    chunk.colEnd = idxCol + 1;
+    // from the first to the last entry of the chunk's collisions, which also takes in the
+    // entries without a collision in between, filtered out when building
+    extendRange(chunk.trackBegin, chunk.trackEnd, trackIndex, idxCol);
+    extendRange(chunk.clusterBegin, chunk.clusterEnd, clusterIndex, idxCol);
+    chunkCost += colCost;
+  }
+  chunks.push_back(chunk);
+
+  for (auto &ch : chunks) {
+    if (!tracksSorted) { ch.trackBegin = 0; ch.trackEnd = nTracks; }
+    if (!clustersSorted) { ch.clusterBegin = 0; ch.clusterEnd = nClusters; }
+  }
+  logInfo("   Estimated DF size of ", estimate / (1 << 20), " MB exceeds the budget of ", budget / (1 << 20),
+          " MB, splitting ", nCollisions, " collisions into ", chunks.size(), " chunks");
+  for (auto &ch : chunks)
+    logDebug("     Chunk: collisions [", ch.colBegin, ", ", ch.colEnd, "), tracks [", ch.trackBegin, ", ", ch.trackEnd,
+             "), clusters [", ch.clusterBegin, ", ", ch.clusterEnd, ")");
+  return chunks;
+}
+
+// map of track index of matched tracks -> track's etaEMCAL, phiEMCAL, p, pt, sel, etaDiff, phiDiff, eta, phi
+using MatchedTrackMap = std::unordered_map<Int_t, std::tuple<Float_t, Float_t, Float_t, Float_t, uint8_t, Float_t, Float_t, Float_t, Float_t>>;
+
+// EMCAL matches of the tracks, read once per DF. A DF built in one go takes them all; the
+// chunks of a split DF each read on from where the previous chunk stopped until they have
+// the tracks matched to their clusters, and the entries passed on the way are kept for
+// the tracks matched again by a later chunk.
+struct EMCALMatches {
+  TTreeReader *reader;
+  bool chunked;
+  TTreeReaderValue<Int_t> trackIdx;
+  TTreeReaderValue<Float_t> etaEMCAL;
+  TTreeReaderValue<Float_t> phiEMCAL;
+  TTreeReaderValue<Float_t> etaDiff;
+  TTreeReaderValue<Float_t> phiDiff;
+  // etaEMCAL, phiEMCAL, etaDiff, phiDiff of the entries read so far, by track index
+  std::unordered_map<Int_t, std::array<Float_t, 4>> seen;
+
+  EMCALMatches(TTreeReader *emctracks, bool chunked)
+      : reader(emctracks), chunked(chunked), trackIdx(*emctracks, "fIndexJTracks"), etaEMCAL(*emctracks, "fEtaEMCAL"),
+        phiEMCAL(*emctracks, "fPhiEMCAL"), etaDiff(*emctracks, "fEtaDiff"), phiDiff(*emctracks, "fPhiDiff") {}
+
+  static void add(TTree *tracks, MatchedTrackMap &matchedTrackMap, Int_t idxTrack, const std::array<Float_t, 4> &emc) {
+    tracks->GetEntry(idxTrack);
+    Float_t matchedTrackPt, matchedTrackEta, matchedTrackP, matchedTrackPhi;
+    UChar_t matchedTrackSel;
+    GetLeafValue(tracks, "fPt", matchedTrackPt);
+    GetLeafValue(tracks, "fEta", matchedTrackEta);
+    GetLeafValue(tracks, "fPhi", matchedTrackPhi);
+    GetLeafValue(tracks, "fTrackSel", matchedTrackSel);
+    matchedTrackP = matchedTrackPt * cosh(matchedTrackEta);
+    // map each track index to its etaEMCAL, phiEMCAL, p, pt, sel
+    matchedTrackMap.try_emplace(idxTrack, emc[0], emc[1], matchedTrackP, matchedTrackPt, matchedTrackSel, emc[2], emc[3], matchedTrackEta, matchedTrackPhi);
+  }
+
+  // all the matched tracks of the DF
+  void fillAll(TTree *tracks, MatchedTrackMap &matchedTrackMap) {
+    while (reader->Next())
+      add(tracks, matchedTrackMap, *trackIdx, {*etaEMCAL, *phiEMCAL, *etaDiff, *phiDiff});
+  }
+
+  // the given matched tracks, reading on until all of them were seen or the table ends
+  void fill(TTree *tracks, const std::unordered_set<Int_t> &wanted, MatchedTrackMap &matchedTrackMap) {
+    size_t missing = 0;
+    for (Int_t idxTrack : wanted) missing += !seen.count(idxTrack);
+    while (missing > 0 && reader->Next()) {
+      // the first entry of a track wins, as when reading them all
+      if (seen.try_emplace(*trackIdx, std::array<Float_t, 4>{*etaEMCAL, *phiEMCAL, *etaDiff, *phiDiff}).second &&
+          wanted.count(*trackIdx))
+        missing--;
+    }
+    for (Int_t idxTrack : wanted) {
+      auto it = seen.find(idxTrack);
+      if (it != seen.end()) add(tracks, matchedTrackMap, idxTrack, it->second);
+    }
+  }
+};
+
 std::vector<Event> buildEvents(TTree *collisions, TTree *bc, TTree *tracks,
                                TTree *clusters, TTreeReader *clustertracks,
-                               TTreeReader *emctracks, bool saveClusters) {
+                               EMCALMatches *matches, bool saveClusters,
+                               const CollisionChunk &chunk) {
 
   std::vector<Event> events;
-  logDebug("-> Looping over ", collisions->GetEntries(), " collisions");
+  logDebug("-> Looping over ", chunk.colEnd - chunk.colBegin, " collisions");
 
   // map of collision index -> track indices for collision
   std::unordered_map<int, std::vector<int>> trackMap;
   // map of collision index -> cluster indices for collision
   std::unordered_map<int, std::vector<int>> clusterMap;
   // map of track index of matched tracks -> track's etaEMCAL, phiEMCAL, momentum
-  std::unordered_map<Int_t, std::tuple<Float_t, Float_t, Float_t, Float_t, uint8_t, Float_t, Float_t, Float_t, Float_t>> matchedTrackMap;
+  MatchedTrackMap matchedTrackMap;
   TTreeReaderArray<Int_t> matchedTrackIdxs(*clustertracks, "fIndexArrayJTracks");
 
-  // loop over all tracks and fill map
-  for (int j = 0; j < tracks->GetEntries(); j++) {
+  // loop over the tracks of this chunk and fill map
+  for (Long64_t j = chunk.trackBegin; j < chunk.trackEnd; j++) {
     tracks->GetEntry(j);
     int collisionID;
     GetLeafValue(tracks, "fIndexJCollisions", collisionID);
+    if (collisionID < chunk.colBegin || collisionID >= chunk.colEnd) continue;
     trackMap[collisionID].push_back(j);
   }
 
@@ -210,36 +399,34 @@ std::vector<Event> buildEvents(TTree *collisions, TTree *bc, TTree *tracks,
     if (clusters->GetEntries() != clustertracks->GetEntries())
       throw std::runtime_error("Unequal number of clusters and clustertracks!");
 
-    // loop over all clusters and fill map
-    for (int j = 0; j < clusters->GetEntries(); j++) {
+    // loop over the clusters of this chunk and fill map
+    for (Long64_t j = chunk.clusterBegin; j < chunk.clusterEnd; j++) {
       clusters->GetEntry(j);
       int collisionID;
       GetLeafValue(clusters, "fIndexJCollisions", collisionID);
+      if (collisionID < chunk.colBegin || collisionID >= chunk.colEnd) continue;
       clusterMap[collisionID].push_back(j);
     }
 
-    // loop over matched tracks and build matched track map
-    TTreeReaderValue<Int_t> matchedTrackIdx(*emctracks, "fIndexJTracks");
-    TTreeReaderValue<Float_t> etaEMCAL(*emctracks, "fEtaEMCAL");
-    TTreeReaderValue<Float_t> phiEMCAL(*emctracks, "fPhiEMCAL");
-    TTreeReaderValue<Float_t> etaDiff(*emctracks, "fEtaDiff");
-    TTreeReaderValue<Float_t> phiDiff(*emctracks, "fPhiDiff");
-    while (emctracks->Next()) {
-      tracks->GetEntry(*matchedTrackIdx);
-      Float_t matchedTrackPt, matchedTrackEta, matchedTrackP, matchedTrackPhi;
-      UChar_t matchedTrackSel;
-      GetLeafValue(tracks, "fPt", matchedTrackPt);
-      GetLeafValue(tracks, "fEta", matchedTrackEta);
-      GetLeafValue(tracks, "fPhi", matchedTrackPhi);
-      GetLeafValue(tracks, "fTrackSel", matchedTrackSel);
-      matchedTrackP = matchedTrackPt * cosh(matchedTrackEta);
-      // map each track index to its etaEMCAL, phiEMCAL, p, pt, sel
-      matchedTrackMap.try_emplace(*matchedTrackIdx, *etaEMCAL, *phiEMCAL, matchedTrackP, matchedTrackPt, matchedTrackSel, *etaDiff, *phiDiff, matchedTrackEta, matchedTrackPhi);
+    if (!matches->chunked) {
+      // loop over matched tracks and build matched track map
+      matches->fillAll(tracks, matchedTrackMap);
+    } else {
+      // tracks matched to the clusters of this chunk, which can belong to another collision
+      // and hence lie outside of the chunk's track range
+      std::unordered_set<Int_t> matchedTracks;
+      for (auto &entry : clusterMap)
+        for (int idxCluster : entry.second) {
+          clustertracks->SetEntry(idxCluster);
+          for (const Int_t &idxTrack : matchedTrackIdxs) matchedTracks.insert(idxTrack);
+        }
+      matches->fill(tracks, matchedTracks, matchedTrackMap);
     }
   }
 
   // loop over collisions
-  for (int idxCol = 0; idxCol < collisions->GetEntries(); idxCol++) {
+  events.reserve(chunk.colEnd - chunk.colBegin);
+  for (int idxCol = chunk.colBegin; idxCol < chunk.colEnd; idxCol++) {
     collisions->GetEntry(idxCol);
     Event ev;
     int idxBC;
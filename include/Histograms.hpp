@@ -0,0 +1,259 @@
+#ifndef HISTOGRAMS_HPP
+#define HISTOGRAMS_HPP
+
+#include "EventBuilding.hpp"
+#include "logger.hpp"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <TH1F.h>
+#include <TH2F.h>
+#include <TList.h>
+
+#include <yaml-cpp/yaml.h>
+
+// default QA histograms, used when the config has no histograms section
+#define HISTOGRAMS_DO(defH1, defH2)                                                      \
+  /* TH1F */                                                                             \
+  defH1(hTrackPt,       "Track p_{T}",      track_pt,       100, 0,   100)               \
+  defH1(hClusterEnergy, "Cluster Energy",   cluster_energy, 100, 0,   100)               \
+  defH1(hClusterEta,    "Cluster #eta",     cluster_eta,    100, -1,  1)                 \
+  defH1(hClusterPhi,    "Cluster #phi",     cluster_phi,    100, 0,   2 * 3.14)          \
+  defH1(hNEvents,       "Number of events", event_count,    2,   0,   2)                 \
+  defH1(hEvtVtxX,       "Event vertex x",   vtx_x,          100, -10, 10)                \
+  defH1(hEvtVtxY,       "Event vertex y",   vtx_y,          100, -10, 10)                \
+  defH1(hEvtVtxZ,       "Event vertex z",   vtx_z,          100, -10, 10)                \
+  /* TH2F */                                                                             \
+  defH2(hClusterM02vsE, "Cluster M02 vs E", cluster_m02, 300, 0, 3, cluster_energy, 100, 0, 100)
+
+// object a histogrammed quantity is computed from
+enum class HistLevel { Event, Track, Cluster };
+
+// whether histograms are filled with everything read, or only with what is written out
+enum class HistStage { Before = 0, After, NSTAGES };
+
+struct HistVariable {
+  HistLevel level;
+  double (*fromEvent)(const Event &) = nullptr;
+  double (*fromTrack)(const Track &) = nullptr;
+  double (*fromCluster)(const Cluster &) = nullptr;
+};
+
+inline const std::map<std::string, HistVariable> &histVariables() {
+  static const std::map<std::string, HistVariable> variables = {
+    {"event_count",             {HistLevel::Event, [](const Event &)    -> double { return 1; }}},
+    {"run_number",              {HistLevel::Event, [](const Event &ev)  -> double { return ev.col.runNumber; }}},
+    {"vtx_x",                   {HistLevel::Event, [](const Event &ev)  -> double { return ev.col.posX; }}},
+    {"vtx_y",                   {HistLevel::Event, [](const Event &ev)  -> double { return ev.col.posY; }}},
+    {"vtx_z",                   {HistLevel::Event, [](const Event &ev)  -> double { return ev.col.posZ; }}},
+    {"multiplicity",            {HistLevel::Event, [](const Event &ev)  -> double { return ev.col.multiplicity; }}},
+    {"centrality",              {HistLevel::Event, [](const Event &ev)  -> double { return ev.col.centrality; }}},
+    {"occupancy",               {HistLevel::Event, [](const Event &ev)  -> double { return ev.col.trackOccupancyInTimeRange; }}},
+    {"track_pt",                {HistLevel::Track, nullptr, [](const Track &tr) -> double { return tr.pt; }}},
+    {"track_eta",               {HistLevel::Track, nullptr, [](const Track &tr) -> double { return tr.eta; }}},
+    {"track_phi",               {HistLevel::Track, nullptr, [](const Track &tr) -> double { return tr.phi; }}},
+    {"cluster_energy",          {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.energy; }}},
+    {"cluster_eta",             {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.eta; }}},
+    {"cluster_phi",             {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.phi; }}},
+    {"cluster_m02",             {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.m02; }}},
+    {"cluster_m20",             {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.m20; }}},
+    {"cluster_ncells",          {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.ncells; }}},
+    {"cluster_time",            {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.time; }}},
+    {"cluster_nlm",             {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.nlm; }}},
+    {"cluster_dbc",             {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.distanceToBadChannel; }}},
+    {"cluster_defn",            {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.definition; }}},
+    {"cluster_matched_track_n", {HistLevel::Cluster, nullptr, nullptr, [](const Cluster &cl) -> double { return cl.matchedTrackN; }}},
+  };
+  return variables;
+}
+
+struct HistAxis {
+  std::string var;
+  int nbins;
+  double min, max;
+};
+
+struct HistSpec {
+  std::string name;
+  std::string title;
+  HistAxis x;
+  bool is2D = false;
+  HistAxis y;
+  bool stages[(int)HistStage::NSTAGES] = {true, false};
+};
+
+// plain bin counts, cheap to fill; merged into the ROOT histograms at the end
+struct HistAccumulator {
+  const HistVariable *x;
+  const HistVariable *y;
+  HistAxis xAxis, yAxis;
+  std::vector<double> counts;
+  double entries = 0;
+
+  static int bin(double value, const HistAxis &axis) {
+    if (value < axis.min) return 0;
+    if (!(value < axis.max)) return axis.nbins + 1; // also catches NaN
+    return 1 + int((value - axis.min) / (axis.max - axis.min) * axis.nbins);
+  }
+
+  template<class T>
+  void fill(const T &obj, double (*HistVariable::*getter)(const T &)) {
+    int ix = bin((x->*getter)(obj), xAxis);
+    int iy = y ? bin((y->*getter)(obj), yAxis) : 0;
+    counts[ix + iy * (xAxis.nbins + 2)]++;
+    entries++;
+  }
+};
+
+class HistogramManager {
+  std::vector<HistSpec> specs;
+  // one ROOT histogram and one accumulator slot per (spec, stage) pair in use
+  std::vector<TH1 *> hists;
+  std::vector<HistAccumulator> prototype;
+  std::vector<size_t> filled[(int)HistStage::NSTAGES][3];
+
+  // accumulators of every thread that filled, merged when finishing
+  uint64_t id;
+  std::mutex mtx;
+  std::vector<std::unique_ptr<std::vector<HistAccumulator>>> perThread;
+
+  static HistAxis parseAxis(const YAML::Node &node, const std::string &name) {
+    if (!node || !node["var"] || !node["bins"] || !node["min"] || !node["max"])
+      throw std::runtime_error("Histogram '" + name + "' needs an axis with var, bins, min and max");
+    return {node["var"].as<std::string>(), node["bins"].as<int>(), node["min"].as<double>(), node["max"].as<double>()};
+  }
+
+  static const HistVariable &variable(const std::string &var, const std::string &name) {
+    auto it = histVariables().find(var);
+    if (it == histVariables().end())
+      throw std::runtime_error("Unknown variable '" + var + "' in histogram '" + name + "'");
+    return it->second;
+  }
+
+public:
+  HistogramManager() {
+    static std::atomic<uint64_t> nextId{0};
+    id = nextId++;
+  }
+
+  void configure(const YAML::Node &config) {
+    if (!config || config.IsNull()) {
+#define DEFAULT_H1(name, title, var, nbins, xlow, xup) \
+      specs.push_back({#name, title, {#var, nbins, xlow, xup}});
+#define DEFAULT_H2(name, title, xvar, nx, xlow, xup, yvar, ny, ylow, yup) \
+      specs.push_back({#name, title, {#xvar, nx, xlow, xup}, true, {#yvar, ny, ylow, yup}});
+      HISTOGRAMS_DO(DEFAULT_H1, DEFAULT_H2)
+#undef DEFAULT_H1
+#undef DEFAULT_H2
+      return;
+    }
+    for (const auto &node : config) {
+      HistSpec spec;
+      spec.name = node["name"].as<std::string>();
+      spec.title = node["title"] ? node["title"].as<std::string>() : spec.name;
+      spec.x = parseAxis(node["x"], spec.name);
+      if (node["y"]) {
+        spec.is2D = true;
+        spec.y = parseAxis(node["y"], spec.name);
+      }
+      std::string stage = node["stage"] ? node["stage"].as<std::string>() : "before";
+      if (stage != "before" && stage != "after" && stage != "both")
+        throw std::runtime_error("Histogram '" + spec.name + "' has stage '" + stage + "', expected before, after or both");
+      spec.stages[(int)HistStage::Before] = stage != "after";
+      spec.stages[(int)HistStage::After] = stage != "before";
+      specs.push_back(spec);
+    }
+  }
+
+  // book the ROOT histograms in the current directory and add them to the output list
+  void book(TList *output) {
+    for (const auto &spec : specs) {
+      const HistVariable &x = variable(spec.x.var, spec.name);
+      const HistVariable *y = spec.is2D ? &variable(spec.y.var, spec.name) : nullptr;
+      if (y && y->level != x.level)
+        throw std::runtime_error("Histogram '" + spec.name + "' mixes variables of different objects");
+      bool both = spec.stages[(int)HistStage::Before] && spec.stages[(int)HistStage::After];
+      for (int stage = 0; stage < (int)HistStage::NSTAGES; stage++) {
+        if (!spec.stages[stage]) continue;
+        std::string name = spec.name;
+        if (both) name += stage == (int)HistStage::Before ? "_before" : "_after";
+        TH1 *h;
+        if (y)
+          h = new TH2F(name.c_str(), spec.title.c_str(), spec.x.nbins, spec.x.min, spec.x.max, spec.y.nbins, spec.y.min, spec.y.max);
+        else
+          h = new TH1F(name.c_str(), spec.title.c_str(), spec.x.nbins, spec.x.min, spec.x.max);
+        output->Add(h);
+        filled[stage][(int)x.level].push_back(hists.size());
+        hists.push_back(h);
+        HistAccumulator acc{&x, y, spec.x, y ? spec.y : HistAxis{}};
+        acc.counts.assign((spec.x.nbins + 2) * (y ? spec.y.nbins + 2 : 1), 0.);
+        prototype.push_back(acc);
+        logInfo("Histogram ", name, ": ", spec.x.var, y ? " vs " + spec.y.var : "",
+                stage == (int)HistStage::Before ? " before cuts" : " after cuts");
+      }
+    }
+  }
+
+  // accumulators of the calling thread, created on first use
+  std::vector<HistAccumulator> &local() {
+    thread_local std::unordered_map<uint64_t, std::vector<HistAccumulator> *> cache;
+    auto it = cache.find(id);
+    if (it != cache.end()) return *it->second;
+    std::lock_guard<std::mutex> lock(mtx);
+    perThread.push_back(std::make_unique<std::vector<HistAccumulator>>(prototype));
+    cache[id] = perThread.back().get();
+    return *perThread.back();
+  }
+
+  bool fills(HistStage stage, HistLevel level) const { return !filled[(int)stage][(int)level].empty(); }
+
+  void fillEvent(std::vector<HistAccumulator> &acc, HistStage stage, const Event &ev) const {
+    for (size_t i : filled[(int)stage][(int)HistLevel::Event]) acc[i].fill(ev, &HistVariable::fromEvent);
+  }
+  void fillTrack(std::vector<HistAccumulator> &acc, HistStage stage, const Track &tr) const {
+    for (size_t i : filled[(int)stage][(int)HistLevel::Track]) acc[i].fill(tr, &HistVariable::fromTrack);
+  }
+  void fillCluster(std::vector<HistAccumulator> &acc, HistStage stage, const Cluster &cl) const {
+    for (size_t i : filled[(int)stage][(int)HistLevel::Cluster]) acc[i].fill(cl, &HistVariable::fromCluster);
+  }
+
+  // fill everything read for one event, regardless of the cuts
+  void fillBefore(std::vector<HistAccumulator> &acc, const Event &ev) const {
+    fillEvent(acc, HistStage::Before, ev);
+    if (fills(HistStage::Before, HistLevel::Track))
+      for (auto &tr : ev.tracks) fillTrack(acc, HistStage::Before, tr);
+    if (fills(HistStage::Before, HistLevel::Cluster))
+      for (auto &cl : ev.clusters) fillCluster(acc, HistStage::Before, cl);
+  }
+
+  // add the counts of all threads to the ROOT histograms
+  void merge() {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (auto &accs : perThread) {
+      for (size_t i = 0; i < hists.size(); i++) {
+        HistAccumulator &acc = (*accs)[i];
+        // setting a bin content counts an entry, so the number of entries is set at the end
+        double entries = hists[i]->GetEntries();
+        TArrayD *sumw2 = hists[i]->GetSumw2N() ? hists[i]->GetSumw2() : nullptr;
+        for (size_t bin = 0; bin < acc.counts.size(); bin++) {
+          if (acc.counts[bin] == 0) continue;
+          // accumulator bins are laid out like ROOT's global bin numbers
+          hists[i]->SetBinContent(bin, hists[i]->GetBinContent(bin) + acc.counts[bin]);
+          // unit weights, so the sum of squared weights grows like the counts; setting the
+          // content leaves it alone
+          if (sumw2) sumw2->AddAt(sumw2->At(bin) + acc.counts[bin], bin);
+        }
+        hists[i]->SetEntries(entries + acc.entries);
+        std::fill(acc.counts.begin(), acc.counts.end(), 0.);
+        acc.entries = 0;
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef OUTPUT_TREE_HPP
+#define OUTPUT_TREE_HPP
+
+#include <vector>
+
+#include <TFile.h>
+#include <TTree.h>
+
+struct EventBlock;
+
+// leaf-list array branch of the flat layout, pointing into a column of the event block
+// at the entries of the event being filled
+struct FlatBranch {
+  TBranch *branch;
+  void *(*data)(EventBlock &, size_t);
+  void *bound;
+};
+
+// an output tree and the file it is written to
+struct OutputTree {
+  TFile *file = nullptr;
+  TTree *tree = nullptr;
+  std::vector<FlatBranch> flatBranches;
+};
+
+// Create a branch, or point the existing one at the buffer when appending to a tree
+// read back from a reopened file.
+template<class T>
+TBranch *bindBranch(TTree *tree, const char *name, T *address) {
+  if (TBranch *branch = tree->GetBranch(name)) {
+    tree->SetBranchAddress(name, address);
+    return branch;
+  }
+  return tree->Branch(name, address);
+}
+
+inline TBranch *bindBranch(TTree *tree, const char *name, void *address, const char *leaflist) {
+  if (TBranch *branch = tree->GetBranch(name)) {
+    branch->SetAddress(address);
+    return branch;
+  }
+  return tree->Branch(name, address, leaflist);
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef RUN_SHARDS_HPP
+#define RUN_SHARDS_HPP
+
+#include "OutputTree.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+#include <TFile.h>
+#include <TTree.h>
+
+// Per-run output files, <directory>/run_<run>/<name>, of which at most maxOpen are open at
+// once. When a new run needs a file, the least recently written one is closed in the
+// background (ROOT::EnableThreadSafety must be on), and reopened in UPDATE mode if the
+// run shows up again.
+class RunShards {
+  using Booker = std::function<void(OutputTree &)>;
+
+  std::filesystem::path directory;
+  std::string name;
+  size_t maxOpen;
+  Booker book;
+
+  // most recently used run first
+  std::list<int> lru;
+  std::map<int, std::pair<OutputTree, std::list<int>::iterator>> open;
+  std::map<int, std::future<void>> closing;
+  std::set<int> created;
+
+  // last shard returned, events of a DF usually all belong to the same run
+  int lastRun = 0;
+  OutputTree *last = nullptr;
+
+  static void close(OutputTree out) {
+    out.file->cd();
+    out.tree->Write("", TObject::kOverwrite);
+    out.file->Close();
+    delete out.file;
+  }
+
+  void evict() {
+    int run = lru.back();
+    lru.pop_back();
+    logDebug("Closing the output of run ", run, " in the background");
+    closing[run] = std::async(std::launch::async, close, open.at(run).first);
+    open.erase(run);
+    if (lastRun == run) last = nullptr;
+  }
+
+  std::filesystem::path path(int run) const {
+    return directory / ("run_" + std::to_string(run)) / name;
+  }
+
+public:
+  RunShards(const std::string &outputFilename, size_t maxOpen, Booker book)
+      : maxOpen(std::max<size_t>(1, maxOpen)), book(book) {
+    std::filesystem::path output(outputFilename);
+    directory = output.parent_path();
+    name = output.filename().string();
+  }
+
+  ~RunShards() {
+    try {
+      closeAll();
+    } catch (const std::exception &e) {
+      logError("Closing the run outputs failed: ", e.what());
+    }
+  }
+
+  OutputTree &get(int run) {
+    if (last && run == lastRun) return *last;
+    auto it = open.find(run);
+    if (it != open.end()) {
+      lru.splice(lru.begin(), lru, it->second.second);
+    } else {
+      if (open.size() >= maxOpen) evict();
+      // a run being closed in the background must be fully written before it is reopened
+      auto pending = closing.find(run);
+      if (pending != closing.end()) {
+        pending->second.get();
+        closing.erase(pending);
+      }
+
+      std::filesystem::path file = path(run);
+      std::filesystem::create_directories(file.parent_path());
+      bool reopen = created.count(run);
+      OutputTree out;
+      out.file = new TFile(file.c_str(), reopen ? "UPDATE" : "RECREATE");
+      if (out.file->IsZombie())
+        throw std::runtime_error("Output file " + file.string() + " could not be opened");
+      logInfo(reopen ? "Reopening" : "Creating", " the output of run ", run, ": ", file.string());
+      book(out);
+      created.insert(run);
+
+      lru.push_front(run);
+      it = open.emplace(run, std::make_pair(out, lru.begin())).first;
+    }
+    lastRun = run;
+    last = &it->second.first;
+    return *last;
+  }
+
+  // number of runs written so far
+  size_t runs() const { return created.size(); }
+
+  // close every run, in parallel
+  void closeAll() {
+    while (!lru.empty()) evict();
+    for (auto &[run, pending] : closing) pending.get();
+    closing.clear();
+  }
+};
+
+#endif
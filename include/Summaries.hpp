@@ -0,0 +1,150 @@
+#ifndef SUMMARIES_HPP
+#define SUMMARIES_HPP
+
+#include "AsyncWriter.hpp"
+#include "OutputTree.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <TTree.h>
+
+#include <yaml-cpp/yaml.h>
+
+// per-object columns of the output tree that summaries can be computed over, as named
+// in the event blocks
+#define SUMMARY_COLUMNS_DO(defTrack, defCluster) \
+  defTrack(track_pt)                             \
+  defTrack(track_eta)                            \
+  defTrack(track_phi)                            \
+  defCluster(cluster_energy)                     \
+  defCluster(cluster_eta)                        \
+  defCluster(cluster_phi)                        \
+  defCluster(cluster_m02)                        \
+  defCluster(cluster_m20)                        \
+  defCluster(cluster_ncells)                     \
+  defCluster(cluster_time)                       \
+  defCluster(cluster_nlm)                        \
+  defCluster(cluster_dbc)
+
+enum class SummaryOp { Max, Min, Sum, Count };
+
+// reads one column of the event being written, i.e. after the cuts
+struct SummaryColumn {
+  bool cluster;
+  double (*at)(const EventBlock &, size_t);
+};
+
+inline const std::map<std::string, SummaryColumn> &summaryColumns() {
+#define SUMMARY_COLUMN(name, isCluster) \
+  {#name, {isCluster, [](const EventBlock &block, size_t i) -> double { return block.name[i]; }}},
+#define SUMMARY_TRACK(name) SUMMARY_COLUMN(name, false)
+#define SUMMARY_CLUSTER(name) SUMMARY_COLUMN(name, true)
+  static const std::map<std::string, SummaryColumn> columns = {
+    SUMMARY_COLUMNS_DO(SUMMARY_TRACK, SUMMARY_CLUSTER)
+  };
+#undef SUMMARY_TRACK
+#undef SUMMARY_CLUSTER
+#undef SUMMARY_COLUMN
+  return columns;
+}
+
+struct Summary {
+  std::string name;
+  SummaryOp op;
+  const SummaryColumn *column;
+  // only entries at or above the threshold are reduced
+  double threshold = -std::numeric_limits<double>::infinity();
+  // branch buffers: count is written as an integer, the rest as floats
+  Int_t count;
+  Float_t value;
+
+  // over the entries [begin, end) of the column in the block
+  void compute(const EventBlock &block, size_t begin, size_t end) {
+    double result = op == SummaryOp::Max ? -std::numeric_limits<double>::infinity()
+                  : op == SummaryOp::Min ? std::numeric_limits<double>::infinity() : 0;
+    int selected = 0;
+    for (size_t i = begin; i < end; i++) {
+      double x = column->at(block, i);
+      if (x < threshold) continue;
+      selected++;
+      if (op == SummaryOp::Max) result = std::max(result, x);
+      else if (op == SummaryOp::Min) result = std::min(result, x);
+      else if (op == SummaryOp::Sum) result += x;
+    }
+    count = selected;
+    // max and min of nothing are NaN, so that any cut on them rejects the event
+    if (!selected && (op == SummaryOp::Max || op == SummaryOp::Min))
+      result = std::numeric_limits<double>::quiet_NaN();
+    value = (Float_t)result;
+  }
+};
+
+// Scalar per-event reductions of the track and cluster columns, computed while
+// writing so readers can preselect events without reading the vector branches.
+class SummaryManager {
+  std::vector<Summary> summaries;
+
+  static SummaryOp parseOp(const std::string &op, const std::string &name) {
+    if (op == "max") return SummaryOp::Max;
+    if (op == "min") return SummaryOp::Min;
+    if (op == "sum") return SummaryOp::Sum;
+    if (op == "count") return SummaryOp::Count;
+    throw std::runtime_error("Summary '" + name + "' has op '" + op + "', expected max, min, sum or count");
+  }
+
+public:
+  void configure(const YAML::Node &config, bool saveClusters) {
+    if (!config || config.IsNull()) return;
+    for (const auto &node : config) {
+      if (!node["name"] || !node["op"] || !node["column"])
+        throw std::runtime_error("Summaries need a name, op and column");
+      Summary summary;
+      summary.name = node["name"].as<std::string>();
+      summary.op = parseOp(node["op"].as<std::string>(), summary.name);
+      std::string column = node["column"].as<std::string>();
+      auto it = summaryColumns().find(column);
+      if (it == summaryColumns().end())
+        throw std::runtime_error("Unknown column '" + column + "' in summary '" + summary.name + "'");
+      if (it->second.cluster && !saveClusters)
+        throw std::runtime_error("Summary '" + summary.name + "' needs clusters, which are not saved");
+      summary.column = &it->second;
+      if (node["threshold"] && !node["threshold"].IsNull())
+        summary.threshold = node["threshold"].as<double>();
+      summaries.push_back(summary);
+    }
+  }
+
+  bool empty() const { return summaries.empty(); }
+
+  // the summaries must not be added after this, the branches point into them;
+  // a reopened tree already has the summary branches, which are bound again
+  void book(TTree *tree, bool reopened = false) {
+    for (auto &summary : summaries) {
+      if (!reopened && tree->GetBranch(summary.name.c_str()))
+        throw std::runtime_error("Summary '" + summary.name + "' clashes with an existing branch");
+      if (summary.op == SummaryOp::Count)
+        bindBranch(tree, summary.name.c_str(), &summary.count, (summary.name + "/I").c_str());
+      else
+        bindBranch(tree, summary.name.c_str(), &summary.value, (summary.name + "/F").c_str());
+      if (!reopened) logInfo("Summary branch ", summary.name);
+    }
+  }
+
+  // compute all summaries of an event of the block
+  void compute(const EventBlock &block, size_t event) {
+    for (auto &summary : summaries) {
+      if (summary.column->cluster)
+        summary.compute(block, block.clusterBegin(event), block.clusterEnd[event]);
+      else
+        summary.compute(block, block.trackBegin(event), block.trackEnd[event]);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,188 @@
+#!/usr/bin/bash
+
+# Thin client for the converter service (converter --serve). Submits one conversion to
+# the service owning the spool directory, starting the service first if none is running,
+# and waits for its reply.
+#
+# There is one service per spool directory, which outlives the client that started it
+# and serves the clients of later jobs on the node, until it has been idle for
+# --idle-timeout seconds or the allocation it runs in ends. It converts one request at a
+# time, oldest first, so concurrent clients queue in the spool directory.
+#
+# Exit codes: 0 on success, 1 if the conversion failed, 3 if the service could not take
+# the request (the caller should then run the converter directly).
+
+source "$(dirname "${BASH_SOURCE[0]}")/util.sh"
+
+usage() {
+    echo "Usage: $0 --spool <dir> --server '<cmd>' [--idle-timeout <s>] [--timeout <s>] -- <converter options>"
+    echo "  --spool         Spool directory shared by the clients and the service, preferably node-local"
+    echo "  --server        Command starting the converter, '--serve <spool>' is appended"
+    echo "  --idle-timeout  Seconds the service stays up without requests (default: 600)"
+    echo "  --timeout       Seconds to wait for an idle service to pick up the request (default: 120)"
+    echo "  Supported converter options: -i, -o, -c, --save-clusters, --create-histograms,"
+    echo "  --max-memory=<MB>, --layout=<vector|flat>, --shard-by-run, --max-open-runs=<n>, --async-write,"
+    echo "  --imt=<n>, --catalog=<file>, --staged-input, --original-filelist=<file>;"
+    echo "  -v flags are accepted and ignored."
+}
+
+spool=""
+server=""
+idle_timeout=600
+timeout=120
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --spool) spool="$2"; shift 2 ;;
+        --server) server="$2"; shift 2 ;;
+        --idle-timeout) idle_timeout="$2"; shift 2 ;;
+        --timeout) timeout="$2"; shift 2 ;;
+        --) shift; break ;;
+        -h|--help) usage; exit 0 ;;
+        *) error "Unknown option: $1"; usage; exit 3 ;;
+    esac
+done
+
+input=""
+output=""
+config=""
+save_clusters=false
+create_histograms=false
+staged_input=false
+max_memory=0
+layout=""
+shard_by_run=false
+max_open_runs=16
+async_write=false
+imt=0
+catalog=""
+original_filelist=""
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -i|--input) input="$2"; shift 2 ;;
+        -o|--output) output="$2"; shift 2 ;;
+        -c|--config) config="$2"; shift 2 ;;
+        --save-clusters) save_clusters=true; shift ;;
+        --create-histograms) create_histograms=true; shift ;;
+        --staged-input) staged_input=true; shift ;;
+        --max-memory=*) max_memory="${1#*=}"; shift ;;
+        --max-memory) max_memory="$2"; shift 2 ;;
+        --layout=*) layout="${1#*=}"; shift ;;
+        --layout) layout="$2"; shift 2 ;;
+        --shard-by-run) shard_by_run=true; shift ;;
+        --max-open-runs=*) max_open_runs="${1#*=}"; shift ;;
+        --max-open-runs) max_open_runs="$2"; shift 2 ;;
+        --async-write) async_write=true; shift ;;
+        --imt=*) imt="${1#*=}"; shift ;;
+        --imt) imt="$2"; shift 2 ;;
+        --catalog=*) catalog="${1#*=}"; shift ;;
+        --catalog) catalog="$2"; shift 2 ;;
+        --original-filelist=*) original_filelist="${1#*=}"; shift ;;
+        --original-filelist) original_filelist="$2"; shift 2 ;;
+        -v*) shift ;;
+        *) error "Unsupported converter option: $1"; exit 3 ;;
+    esac
+done
+
+if [ -z "$spool" ] || [ -z "$server" ] || [ -z "$input" ] || [ -z "$output" ] || [ -z "$config" ]; then
+    usage
+    exit 3
+fi
+
+mkdir -p "$spool/incoming" "$spool/active" "$spool/done"
+
+# the service resolves paths from its own working directory
+input=$(realpath "$input")
+output=$(realpath -m "$output")
+config=$(realpath "$config")
+[ -n "$catalog" ] && catalog=$(realpath "$catalog")
+[ -n "$original_filelist" ] && original_filelist=$(realpath "$original_filelist")
+
+service_alive() { ! flock -n "$spool/server.lock" true; }
+
+if [ -f "$spool/drain" ] && service_alive; then
+    warn "Converter service is shutting down"
+    exit 3
+fi
+
+if ! service_alive; then
+    info "Starting converter service on $spool"
+    rm -f "$spool/shutdown" "$spool/drain"
+    # in its own session, so that stopping this client, e.g. from the work queue, does not
+    # stop it with the requests of other clients
+    setsid $server --serve "$spool" --idle-timeout "$idle_timeout" >> "$spool/service.log" 2>&1 < /dev/null &
+    service_pid=$!
+    # until it holds the lock; a service started at the same time by another client may win
+    while ! service_alive && kill -0 "$service_pid" 2>/dev/null; do sleep 0.1; done
+    if ! service_alive; then
+        warn "Converter service did not start, see $spool/service.log"
+        exit 3
+    fi
+fi
+
+id="$(hostname -s)_$$_$(date +%s%N)"
+request="$spool/incoming/$id.yaml"
+cat > "$spool/incoming/.$id.tmp" <<EOF
+input: "$input"
+output: "$output"
+config: "$config"
+save_clusters: $save_clusters
+create_histograms: $create_histograms
+staged_input: $staged_input
+max_memory: $max_memory
+layout: "$layout"
+shard_by_run: $shard_by_run
+max_open_runs: $max_open_runs
+async_write: $async_write
+imt: $imt
+catalog: "$catalog"
+original_filelist: "$original_filelist"
+EOF
+mv "$spool/incoming/.$id.tmp" "$request"
+
+# wait for the request to be claimed, behind the requests submitted before it; give up if
+# the service stays idle without picking it up in time, or if the service ends before
+waited=0
+while [ -f "$request" ]; do
+    service_alive
+    alive=$?
+    if (( waited >= timeout * 10 )) || (( alive != 0 )); then
+        # only withdraw it if the service did not claim it in the meantime
+        if rm "$request" 2>/dev/null; then
+            if (( alive != 0 )); then
+                warn "Converter service ended before picking up request $id"
+            else
+                warn "Converter service did not pick up request $id within $timeout s"
+            fi
+            exit 3
+        fi
+        break
+    fi
+    sleep 0.1
+    # the time spent converting the requests of other clients does not count
+    [ -n "$(ls -A "$spool/active")" ] || waited=$(( waited + 1 ))
+done
+
+info "Request $id accepted by the converter service"
+reply="$spool/done/$id.yaml"
+while [ ! -f "$reply" ]; do
+    if ! service_alive && [ ! -f "$reply" ]; then
+        warn "Converter service stopped while serving request $id"
+        rm -f "$spool/active/$id.yaml"
+        exit 3
+    fi
+    sleep 1
+done
+
+cat "$reply" | pstdout
+status=$(sed -n 's/^status: *//p' "$reply")
+message=$(sed -n 's/^message: *//p' "$reply")
+rm -f "$reply"
+if [[ "$message" == interrupted* ]]; then
+    warn "Request $id was interrupted by the end of the converter service"
+    exit 3
+fi
+if [ "$status" != "ok" ]; then
+    error "Conversion failed in the converter service"
+    exit 1
+fi
+exit 0
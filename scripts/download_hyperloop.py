@@ -6,17 +6,22 @@
 # This tool is meant to download files from Hyperloop
 # Arguments:
 # -c / --config: The YAML configuration file
+# --data-root: Directory holding all datasets (CFS by default)
 # ---------------------------------------------
 # Example usage:
 # python download_hyperloop.py --config <path/to/config>
 
 import argparse
+import heapq
 import json
 import logging
 import os
+import random
+import re
 import subprocess
 import sys
-from concurrent.futures import ThreadPoolExecutor, as_completed
+import time
+from concurrent.futures import FIRST_COMPLETED, ThreadPoolExecutor, wait
 from datetime import datetime
 from enum import Enum, auto
 from glob import iglob
@@ -30,6 +35,8 @@ log = logging.getLogger('downloader')
 log.setLevel(logging.DEBUG)
 log.addHandler(RichHandler(level = logging.INFO, log_time_format = "[%X]"))
 
+DATA_ROOT = "/global/cfs/cdirs/alice/alicepro/hiccup/rstorage/alice/run3/data"
+
 class Mode(Enum):
     DOWNLOAD = auto()
     RETRY = auto()
@@ -37,11 +44,13 @@ class Mode(Enum):
 
 # create a filepair class that has source and destination string
 class FilePair:
-    def __init__(self, src, dst, ntries = 5, timeout = 40):
+    def __init__(self, src, dst, ntries = 5, timeout = 40, size = 0):
         self.ntries = ntries
         self.timeout = timeout
         self.src = src
         self.dst = dst
+        self.size = size # on the Grid, 0 if unknown
+        self.attempt = 0
 
         self.remote = f"alien://{self.src}"
         self.local  = f"file:{self.dst}"
@@ -68,23 +77,98 @@ class FailedDownloadError(subprocess.CalledProcessError):
         self.src = src
         self.dst = dst
 
+class AdaptiveController:
+    """AIMD control of the number of transfers in flight.
+
+    Every interval, the window of concurrent transfers grows by one while it is fully
+    used and the smoothed throughput still improves, and is halved as soon as transfers
+    start failing (i.e. timing out), like TCP congestion control.
+    """
+    def __init__(self, initial, minimum, maximum, interval, max_failure_rate, log_file):
+        self.minimum = minimum
+        self.maximum = max(minimum, maximum)
+        self.window = min(max(initial, self.minimum), self.maximum)
+        self.interval = interval
+        self.max_failure_rate = max_failure_rate
+
+        self.start = time.monotonic()
+        self.last_update = self.start
+        self.smoothed_rate = 0.
+        self.nbytes = 0
+        self.nsuccess = 0
+        self.nfailed = 0
+        self.total_bytes = 0
+
+        self.log_file = open(log_file, 'a')
+        print("# time [s], window, in flight, succeeded, failed, throughput [MB/s]", file = self.log_file, flush = True)
+
+    def record(self, success, nbytes = 0):
+        if success:
+            self.nsuccess += 1
+            self.nbytes += nbytes
+            self.total_bytes += nbytes
+        else:
+            self.nfailed += 1
+
+    def update(self, ninflight):
+        now = time.monotonic()
+        elapsed = now - self.last_update
+        if elapsed < self.interval:
+            return
+        rate = self.nbytes / elapsed
+        # bytes are only counted once a file completes, so smooth out the bursts
+        last_rate = self.smoothed_rate
+        self.smoothed_rate = 0.5 * (self.smoothed_rate + rate) if self.smoothed_rate else rate
+        ndone = self.nsuccess + self.nfailed
+        failure_rate = self.nfailed / ndone if ndone else 0.
+        print(f"{now - self.start:.1f}, {self.window}, {ninflight}, {self.nsuccess}, {self.nfailed}, {rate / 1048576:.2f}",
+              file = self.log_file, flush = True)
+
+        old_window = self.window
+        if self.nfailed > 1 and failure_rate > self.max_failure_rate:
+            # multiplicative decrease on failures
+            self.window = max(self.minimum, self.window // 2)
+        elif ninflight >= self.window and self.smoothed_rate >= 0.9 * last_rate:
+            # additive increase, only if the current window is in use and still pays off
+            self.window = min(self.maximum, self.window + 1)
+        if self.window != old_window:
+            log.debug(f"Transfer window {old_window} -> {self.window} ({rate / 1048576:.1f} MB/s, {failure_rate:.0%} failed)")
+
+        self.last_update = now
+        self.nbytes = self.nsuccess = self.nfailed = 0
+
+    def close(self):
+        elapsed = time.monotonic() - self.start
+        log.info(f"Transferred {self.total_bytes / 1048576:.0f} MB in {elapsed:.0f} s "
+                 f"({self.total_bytes / 1048576 / max(elapsed, 1e-9):.1f} MB/s), final window: {self.window}")
+        self.log_file.close()
+
 class HyperDownloader:
     _defaults = {
         "filename": "AO2D.root",
         "nthreads": 40,
         "ntries": 5,
-        "timeout": 150
+        "timeout": 150,
+        "stream": False,
+        "adaptive": True,
+        "min_threads": 4,
+        "max_threads": 100,
+        "control_interval": 10,
+        "max_failure_rate": 0.1,
+        "attempts": 3,
+        "backoff": 30,
+        "largest_first": True,
     }
-    def __init__(self, config_file):
+    def __init__(self, config_file, data_root = DATA_ROOT):
         self.check_alien()
 
-        self.configure(config_file)
+        self.configure(config_file, data_root)
 
-    def configure(self, config_file):
+    def configure(self, config_file, data_root):
         cfg = self.get_cfg(config_file)
         self.dataset = cfg["dataset"]
 
-        self.output = f"/global/cfs/cdirs/alice/alicepro/hiccup/rstorage/alice/run3/data/{self.dataset}/AO2D"
+        self.output = f"{data_root}/{self.dataset}/AO2D"
 
         if not os.path.isdir(self.output) or not os.listdir(self.output):
             os.makedirs(self.output)
@@ -120,6 +204,17 @@ class HyperDownloader:
         self.nthreads = cfg["download"].get("nthreads", self._defaults["nthreads"])
         self.ntries = cfg["download"].get("ntries", self._defaults["ntries"])
         self.timeout = cfg["download"].get("timeout", self._defaults["timeout"])
+        self.stream = cfg["download"].get("stream", self._defaults["stream"])
+        self.adaptive = cfg["download"].get("adaptive", self._defaults["adaptive"])
+        self.min_threads = cfg["download"].get("min_threads", self._defaults["min_threads"])
+        self.max_threads = cfg["download"].get("max_threads", self._defaults["max_threads"])
+        self.control_interval = cfg["download"].get("control_interval", self._defaults["control_interval"])
+        self.max_failure_rate = cfg["download"].get("max_failure_rate", self._defaults["max_failure_rate"])
+        self.attempts = cfg["download"].get("attempts", self._defaults["attempts"])
+        self.backoff = cfg["download"].get("backoff", self._defaults["backoff"])
+        self.largest_first = cfg["download"].get("largest_first", self._defaults["largest_first"])
+        if not self.adaptive:
+            self.min_threads = self.max_threads = self.nthreads
 
         log.info( "HyperDownloader configuration:")
         log.info(f"  Mode: {self.mode.name}")
@@ -131,6 +226,24 @@ class HyperDownloader:
         log.info(f"  Threads: {self.nthreads}")
         log.info(f"  Tries per file download: {self.ntries}")
         log.info(f"  Download timeout: {self.timeout}")
+        log.info(f"  Adaptive concurrency: {self.adaptive}")
+        if self.adaptive:
+            log.info(f"    Threads: {self.min_threads} to {self.max_threads}")
+            log.info(f"    Control interval: {self.control_interval} s")
+            log.info(f"    Maximum failure rate: {self.max_failure_rate}")
+        log.info(f"  Attempts per file: {self.attempts}, backing off from {self.backoff} s")
+        log.info(f"  Largest files first: {self.largest_first}")
+        log.info(f"  Stream to converter: {self.stream}")
+
+        # files published to the streaming conversion as soon as they land
+        self.stream_filelist = f"{self.output}/stream_filelist.txt"
+        self.stream_done = f"{self.output}/stream_done"
+        self.published = set()
+        if self.stream and self.mode is not Mode.CONFIRM:
+            if os.path.isfile(self.stream_filelist):
+                self.published = set(self.get_paths_from_file(self.stream_filelist))
+            if os.path.isfile(self.stream_done):
+                os.remove(self.stream_done)
 
     def get_cfg(self, config_file):
         if not config_file.endswith(".yaml"):
@@ -190,13 +303,15 @@ class HyperDownloader:
         aod_paths = [x for x in aod_paths if x.count('/') == max_nslashes]
         log.info(f"Removed potential duplicates. Found {len(aod_paths)} files to download.")
 
+        sizes = self.get_sizes(aod_paths) if self.largest_first else {}
+
         # Set up GRID and local paths
         pairs = []
         for d in aod_paths:
             hy_id = [x for x in d.split('/') if x.startswith('hy_')][0]
             sub_id = d.split('/')[-2]
             local_path = f"{self.output}/{hy_id}/{sub_id}/{d.split('/')[-1]}"
-            pairs.append(FilePair(d, local_path, self.ntries, self.timeout))
+            pairs.append(FilePair(d, local_path, self.ntries, self.timeout, sizes.get(d, 0)))
         nfiles = len(pairs)
 
         if self.mode is Mode.CONFIRM:
@@ -234,6 +349,11 @@ class HyperDownloader:
                 pass
             exit_code = 0
 
+        if self.stream:
+            with open(self.stream_done, 'w'):
+                pass
+            log.info(f"Published {len(self.published)} files to the streaming conversion.")
+
         ao2d_filelist, nfiles = self.create_filelist()
         log.info(f"Download complete: {nfiles} files were downloaded.")
 
@@ -244,56 +364,144 @@ class HyperDownloader:
 
     def download_files(self, pairs):
         nfiles = len(pairs)
-        if self.nthreads > nfiles:
-            log.warning(f"More threads than files, reducing to {nfiles}.")
-            self.nthreads = nfiles
-        log.info(f"Starting download of {nfiles} files with {self.nthreads} threads.")
-        failed = []
-        with ThreadPoolExecutor(max_workers = self.nthreads) as executor, Progress() as progress:
-            task = progress.add_task("[green]Downloading files...", total = nfiles, refresh_per_second = 1)
-            futures = [executor.submit(pair.download) for pair in pairs]
-
-            for future in as_completed(futures):
-                try:
-                    msg = future.result()
-                    log.debug(msg)
-                except FailedDownloadError as e:
-                    log.error(f"Failed download with exit code {e.returncode} after {self.ntries} attempts:")
-                    log.error(e.stdout)
-                    log.error(e.stderr)
-                    failed.append(FilePair(e.src, e.dst, self.ntries, self.timeout))
-                progress.update(task, advance=1)
-
+        log.info(f"Starting download of {nfiles} files.")
+        failed = self.transfer_files(pairs, "[green]Downloading files...", "download", publish = self.stream)
         nfailed = len(failed)
         log.info(f"Completed download: {nfiles - nfailed} successful, {nfailed} failed.")
         return failed
 
-    def confirm_download(self, pairs):
+    def transfer_files(self, pairs, description, label, publish = False):
+        """Run alien_cp on all pairs, adapting the number of transfers in flight.
+
+        Files are started largest first to keep a few big files from dragging out
+        the end of the download. A failed file is retried after an exponential
+        backoff, and given up on after the configured number of attempts.
+        """
         nfiles = len(pairs)
-        if self.nthreads > nfiles:
+        max_threads = self.max_threads
+        if max_threads > nfiles:
             log.warning(f"More threads than files, reducing to {nfiles}.")
-            self.nthreads = nfiles
-        log.info(f"Confirming download of {nfiles} files with {self.nthreads} threads.")
+            max_threads = nfiles
+        controller = AdaptiveController(self.nthreads, min(self.min_threads, max_threads), max_threads,
+                                        self.control_interval, self.max_failure_rate, f"{self.output}/throughput.log")
+        transfer_log = open(f"{self.output}/transfers.log", 'a')
+        print("# source, size [B], attempt, duration [s], status", file = transfer_log, flush = True)
+
+        # (-size, index, pair): the heap pops the largest file first
+        ready = [(-pair.size, i, pair) for i, pair in enumerate(pairs)]
+        heapq.heapify(ready)
+        # (ready time, index, pair) for files backing off after a failure
+        backoff = []
+        inflight = {}
         failed = []
-        with ThreadPoolExecutor(max_workers = self.nthreads) as executor, Progress() as progress:
-            task = progress.add_task("[green]Confirming file download...", total = nfiles, refresh_per_second = 1)
-            futures = [executor.submit(pair.download) for pair in pairs]
 
-            for future in as_completed(futures):
-                try:
-                    msg = future.result()
-                    log.debug(msg)
-                except FailedDownloadError as e:
-                    log.error(f"Failed confirmation with exit code {e.returncode} after {self.ntries} attempts:")
-                    log.error(e.stdout)
-                    log.error(e.stderr)
-                    failed.append(FilePair(e.src, e.dst, self.ntries, self.timeout))
-                progress.update(task, advance=1)
+        def transfer(pair):
+            start = time.monotonic()
+            pair.download()
+            return time.monotonic() - start
+
+        with ThreadPoolExecutor(max_workers = max_threads) as executor, Progress() as progress:
+            task = progress.add_task(description, total = nfiles, refresh_per_second = 1)
+            while ready or backoff or inflight:
+                now = time.monotonic()
+                while backoff and backoff[0][0] <= now:
+                    _, i, pair = heapq.heappop(backoff)
+                    heapq.heappush(ready, (-pair.size, i, pair))
+                while ready and len(inflight) < controller.window:
+                    _, i, pair = heapq.heappop(ready)
+                    pair.attempt += 1
+                    inflight[executor.submit(transfer, pair)] = (i, pair, now)
+                controller.update(len(inflight))
+
+                if not inflight:
+                    # everything left is backing off
+                    time.sleep(min(1, max(0, backoff[0][0] - now)))
+                    continue
+                done, _ = wait(inflight, timeout = 1, return_when = FIRST_COMPLETED)
+                for future in done:
+                    i, pair, start = inflight.pop(future)
+                    try:
+                        duration = future.result()
+                        nbytes = os.path.getsize(pair.dst) if os.path.isfile(pair.dst) else pair.size
+                        controller.record(True, nbytes)
+                        print(f"{pair.src}, {nbytes}, {pair.attempt}, {duration:.1f}, ok", file = transfer_log, flush = True)
+                        log.debug(f"Download success: {pair.remote} to {pair.local}")
+                        if publish:
+                            self.publish(pair)
+                        progress.update(task, advance=1)
+                    except FailedDownloadError as e:
+                        controller.record(False)
+                        print(f"{pair.src}, {pair.size}, {pair.attempt}, {time.monotonic() - start:.1f}, failed {e.returncode}",
+                              file = transfer_log, flush = True)
+                        if pair.attempt < self.attempts:
+                            delay = self.backoff * 2 ** (pair.attempt - 1) * random.uniform(0.5, 1.5)
+                            log.debug(f"Failed {label} of {pair.src} (attempt {pair.attempt}), retrying in {delay:.0f} s")
+                            heapq.heappush(backoff, (time.monotonic() + delay, i, pair))
+                        else:
+                            log.error(f"Failed {label} with exit code {e.returncode} after {pair.attempt} x {self.ntries} attempts:")
+                            log.error(e.stdout)
+                            log.error(e.stderr)
+                            failed.append(FilePair(pair.src, pair.dst, self.ntries, self.timeout, pair.size))
+                            progress.update(task, advance=1)
+
+        controller.close()
+        transfer_log.close()
+        return failed
 
+    def publish(self, pair):
+        """Hand a downloaded file over to the streaming conversion."""
+        if pair.dst in self.published:
+            return
+        # alien_cp already checks the MD5 sum, only guard against empty leftovers
+        if not os.path.isfile(pair.dst) or os.path.getsize(pair.dst) == 0:
+            log.error(f"Downloaded file is missing or empty, not publishing: {pair.dst}")
+            return
+        # the conversion scheduler only counts complete lines, so one write per line is enough
+        with open(self.stream_filelist, 'a') as f:
+            f.write(f"{pair.dst}\n")
+            f.flush()
+            os.fsync(f.fileno())
+        self.published.add(pair.dst)
+        log.debug(f"Published: {pair.dst}")
+
+    def confirm_download(self, pairs):
+        nfiles = len(pairs)
+        log.info(f"Confirming download of {nfiles} files.")
+        failed = self.transfer_files(pairs, "[green]Confirming file download...", "confirmation")
         nfailed = len(failed)
         log.info(f"Completed download confirmation: {nfiles - nfailed} successful, {nfailed} failed.")
         return failed
 
+    def get_sizes(self, paths):
+        """Look up the size of each file on the Grid, caching the result."""
+        sizes_file = f"{self.output}/aod_sizes.txt"
+        sizes = {}
+        if os.path.isfile(sizes_file):
+            for line in self.get_paths_from_file(sizes_file):
+                size, path = line.split(maxsplit = 1)
+                sizes[path] = int(size)
+        missing = [path for path in paths if path not in sizes]
+        if not missing:
+            return sizes
+
+        def stat(path):
+            result = subprocess.run(f'alien_stat {path}', shell = True, encoding = 'utf-8',
+                                    stdout = subprocess.PIPE, stderr = subprocess.PIPE)
+            match = re.search(r"^Size:\s*(\d+)", result.stdout, re.MULTILINE)
+            return path, int(match.group(1)) if match else 0
+
+        log.info(f"Looking up the sizes of {len(missing)} files to download the largest first.")
+        with ThreadPoolExecutor(max_workers = max(1, min(self.nthreads, len(missing)))) as executor, Progress() as progress:
+            task = progress.add_task("[green]Looking up file sizes...", total = len(missing), refresh_per_second = 1)
+            for path, size in executor.map(stat, missing):
+                sizes[path] = size
+                progress.update(task, advance=1)
+        nunknown = sum(1 for path in missing if not sizes[path])
+        if nunknown:
+            log.warning(f"Could not find the size of {nunknown} files, these will be downloaded last.")
+        self.write_paths_to_file(sizes_file, [f"{size} {path}" for path, size in sizes.items()])
+        return sizes
+
     def get_paths_from_file(self, filename):
         with open(filename, 'r') as f:
             paths = f.read().strip().splitlines()
@@ -381,6 +589,7 @@ class HyperDownloader:
                     f"- Train: {self.train}\n"
                     f"- Filename: {self.filename}\n"
                     f"- Number of threads: {self.nthreads}\n"
+                    f"- Adaptive concurrency: {self.adaptive} ({self.min_threads} to {self.max_threads} threads)\n"
                     f"- Number of tries per file download: {self.ntries}\n"
                     f"- Timeout: {self.timeout}\n"
                     f"- Output directory: {self.output}\n\n"
@@ -433,7 +642,8 @@ class HyperDownloader:
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Download a list of files', formatter_class=argparse.ArgumentDefaultsHelpFormatter)
     parser.add_argument('-c', '--config', help='Path to the config YAML file.')
+    parser.add_argument('--data-root', default=DATA_ROOT, help='Directory holding all datasets.')
     args = parser.parse_args()
 
-    downloader = HyperDownloader(args.config)
+    downloader = HyperDownloader(args.config, args.data_root)
     sys.exit(downloader.download())
\ No newline at end of file
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+
+# ---------------------------------------------
+# Local stand-ins for the AliEn command line tools
+# ---------------------------------------------
+# Serves a local directory as if it were the Grid, so that the downloader and
+# the streaming conversion can be exercised without a token or network access.
+# The Grid path /alice/... maps to $LOCAL_ALIEN_ROOT/alice/...
+# Put scripts/local_alien on the PATH to use them in place of the real tools:
+#   export LOCAL_ALIEN_ROOT=/tmp/fakegrid
+#   export PATH=$PWD/scripts/local_alien:$PATH
+# Optional environment:
+#   LOCAL_ALIEN_DELAY: seconds to sleep before each copy (default: 0)
+#   LOCAL_ALIEN_BANDWIDTH: total link bandwidth in MB/s, shared by all copies in flight (default: unlimited)
+#   LOCAL_ALIEN_FAIL_RATE: probability for a copy to fail (default: 0)
+#   LOCAL_ALIEN_MAX_STREAMS: copies in flight beyond which each extra copy adds
+#                            10% failure probability, like a congested link timing out (default: unlimited)
+
+import argparse
+import os
+import random
+import sys
+import time
+from pathlib import Path
+
+def grid_root():
+    root = os.environ.get("LOCAL_ALIEN_ROOT")
+    if not root:
+        print("LOCAL_ALIEN_ROOT is not set", file = sys.stderr)
+        sys.exit(2)
+    return Path(root)
+
+def local_path(grid_path):
+    return grid_root() / grid_path.removeprefix("alien://").lstrip("/")
+
+def token_info(args):
+    print("Local AliEn stand-in: token always valid")
+    return 0
+
+def find(args):
+    parser = argparse.ArgumentParser(prog = "alien_find")
+    parser.add_argument("path")
+    parser.add_argument("pattern")
+    opts = parser.parse_args(args)
+    base = local_path(opts.path)
+    for path in sorted(base.rglob(opts.pattern)):
+        print(f"/{path.relative_to(grid_root())}")
+    return 0
+
+def stat(args):
+    parser = argparse.ArgumentParser(prog = "alien_stat")
+    parser.add_argument("path")
+    opts = parser.parse_args(args)
+    path = local_path(opts.path)
+    if not path.is_file():
+        print(f"No such file: {opts.path}", file = sys.stderr)
+        return 1
+    size = path.stat().st_size
+    print(f"File: {opts.path}")
+    print("Type: f")
+    print(f"Size: {size} ({size / 1048576:.1f} MB)")
+    return 0
+
+def throttled_copy(src, dst, inflight_dir):
+    """Copy in chunks, sharing the simulated link bandwidth with all other copies in flight."""
+    bandwidth = float(os.environ.get("LOCAL_ALIEN_BANDWIDTH", 0)) * 1048576
+    chunk = 1048576
+    with open(src, 'rb') as fin, open(dst, 'wb') as fout:
+        while data := fin.read(chunk):
+            fout.write(data)
+            if bandwidth > 0:
+                ninflight = max(1, len(os.listdir(inflight_dir)))
+                time.sleep(len(data) * ninflight / bandwidth)
+
+def cp(args):
+    parser = argparse.ArgumentParser(prog = "alien_cp")
+    parser.add_argument("-f", action = "store_true")
+    parser.add_argument("-retry", type = int, default = 1)
+    parser.add_argument("-timeout", type = int, default = 0)
+    parser.add_argument("src")
+    parser.add_argument("dst")
+    opts = parser.parse_args(args)
+
+    src = local_path(opts.src)
+    dst = opts.dst.removeprefix("file:")
+    if dst.endswith("/"):
+        dst = f"{dst}{src.name}"
+    if not src.is_file():
+        print(f"No such file: {opts.src}", file = sys.stderr)
+        return 1
+    time.sleep(float(os.environ.get("LOCAL_ALIEN_DELAY", 0)))
+    os.makedirs(os.path.dirname(dst), exist_ok = True)
+
+    # register this copy so that concurrent copies see each other
+    inflight_dir = grid_root() / ".inflight"
+    os.makedirs(inflight_dir, exist_ok = True)
+    token = inflight_dir / str(os.getpid())
+    token.touch()
+    try:
+        ninflight = len(os.listdir(inflight_dir))
+        fail_rate = float(os.environ.get("LOCAL_ALIEN_FAIL_RATE", 0))
+        max_streams = int(os.environ.get("LOCAL_ALIEN_MAX_STREAMS", 0))
+        if max_streams > 0 and ninflight > max_streams:
+            fail_rate += 0.1 * (ninflight - max_streams)
+        throttled_copy(src, dst, inflight_dir)
+        if random.random() < fail_rate:
+            os.remove(dst)
+            print(f"Simulated failure with {ninflight} copies in flight: {opts.src}", file = sys.stderr)
+            return 1
+    finally:
+        token.unlink()
+    return 0
+
+if __name__ == '__main__':
+    commands = {"token-info": token_info, "find": find, "stat": stat, "cp": cp}
+    if len(sys.argv) < 2 or sys.argv[1] not in commands:
+        print(f"Usage: {sys.argv[0]} {{{','.join(commands)}}} [args]", file = sys.stderr)
+        sys.exit(2)
+    sys.exit(commands[sys.argv[1]](sys.argv[2:]))
@@ -6,36 +6,100 @@ import os
 import shutil
 import subprocess
 import sys
+import time
 from pathlib import Path
 
 import yaml
 from rich.logging import RichHandler
 
+from workqueue import WorkQueue
+
 log = logging.getLogger('scheduler')
 log.setLevel(logging.DEBUG)
 log.addHandler(RichHandler(level = logging.INFO, log_time_format = "[%X]"))
 
+DATA_ROOT = "/global/cfs/cdirs/alice/alicepro/hiccup/rstorage/alice/run3/data"
+
+# tables counted in a catalog written by bin/ao2dcatalog, in the order of its columns
+CATALOG_TABLES = ["O2jbc", "O2jcollision", "O2jtrack", "O2jcluster", "O2jclustertrack", "O2jemctrack"]
+
+def read_catalog(filename):
+    """Files of a catalog written by bin/ao2dcatalog, in order, each with its DFs."""
+    files = []
+    with open(filename) as f:
+        for line in f:
+            if not line.strip() or line.startswith("#"):
+                continue
+            fields = line.rstrip("\n").split("\t")
+            entry = {
+                "path": fields[0],
+                "status": fields[2],
+                "bytes": int(fields[3]),
+                "runs": [] if fields[4] == "-" else [int(run) for run in fields[4].split(",")],
+                "counts": {table: None if n == "-" else int(n) for table, n in zip(CATALOG_TABLES, fields[5:])},
+            }
+            if fields[1] == "-":
+                entry["dfs"] = []
+                files.append(entry)
+            else:
+                entry["name"] = fields[1]
+                files[-1]["dfs"].append(entry)
+    return files
+
+def catalog_usable(entry, clusters):
+    """Same rule as the converter: a readable file with a DF holding the tables it reads."""
+    required = CATALOG_TABLES if clusters else CATALOG_TABLES[:3]
+    def df_usable(df):
+        return df["status"] == "ok" and all(df["counts"][table] is not None for table in required)
+    return entry["status"] in ("ok", "recovered") and any(df_usable(df) for df in entry["dfs"])
+
 class Converter:
     _defaults = {
         "test": True,
         "tree_name": "BerkeleyTree.root",
         "save_clusters": False,
+        "create_histograms": False,
         "naod": 10,
         "root_spec": "ROOT/v6-36-04-alice2-2",
         "email": None,
         "recompile": False,
         "verbosity": 1,
+        "staging": False,
+        "staging_dir": None,
+        "staging_budget": 20,
+        "staging_prefetch": 3,
+        "stream_poll": 60,
+        "max_memory": None,
+        "shard_by_run": False,
+        "max_open_runs": 16,
+        "async_write": False,
+        "imt": 0,
+        "catalog": False,
+        "catalog_deep": False,
+        "queue": False,
+        "queue_workers": 16,
+        "queue_ttl": 900,
+        "queue_max_attempts": 3,
+        "service": False,
+        "service_spool": None,
+        "service_idle_timeout": 600,
     }
 
-    def __init__(self, config_file):
-        self.configure(config_file)
+    def __init__(self, config_file, data_root = DATA_ROOT):
+        self.configure(config_file, data_root)
 
-    def configure(self, config_file):
+    def configure(self, config_file, data_root):
         self.base_path = Path(__file__).resolve().parent.parent
         cfg = self.get_cfg(config_file)
         self.dataset = cfg["dataset"]
-        self.input = f"/global/cfs/cdirs/alice/alicepro/hiccup/rstorage/alice/run3/data/{self.dataset}/AO2D/filelist.txt"
-        self.output = f"/global/cfs/cdirs/alice/alicepro/hiccup/rstorage/alice/run3/data/{self.dataset}/BerkeleyTrees"
+        # in streaming mode, the downloader publishes files here as they land
+        self.stream = cfg.get("download", {}).get("stream", False)
+        if self.stream:
+            self.input = f"{data_root}/{self.dataset}/AO2D/stream_filelist.txt"
+            self.stream_done = f"{data_root}/{self.dataset}/AO2D/stream_done"
+        else:
+            self.input = f"{data_root}/{self.dataset}/AO2D/filelist.txt"
+        self.output = f"{data_root}/{self.dataset}/BerkeleyTrees"
 
         os.makedirs(self.output, exist_ok = True)
         shutil.copy2(self.config_file, self.output)
@@ -49,13 +113,42 @@ class Converter:
         self.is_test = cfg["convert"].get("test", self._defaults["test"])
         self.tree_name = cfg["convert"].get("tree_name", self._defaults["tree_name"])
         self.save_clusters = cfg["convert"].get("save_clusters", self._defaults["save_clusters"])
+        self.create_histograms = cfg["convert"].get("create_histograms", self._defaults["create_histograms"])
         self.naod = cfg["convert"].get("naod", self._defaults["naod"])
         self.root_spec = cfg["convert"].get("root_spec", self._defaults["root_spec"])
         self.email = cfg["convert"].get("email", self._defaults["email"])
         self.recompile = cfg["convert"].get("recompile", self._defaults["recompile"])
         self.verbosity = cfg["convert"].get("verbosity", self._defaults["verbosity"])
+        self.staging = cfg["convert"].get("staging", self._defaults["staging"])
+        self.staging_dir = cfg["convert"].get("staging_dir", self._defaults["staging_dir"])
+        self.staging_budget = cfg["convert"].get("staging_budget", self._defaults["staging_budget"])
+        self.staging_prefetch = cfg["convert"].get("staging_prefetch", self._defaults["staging_prefetch"])
+        self.stream_poll = cfg["convert"].get("stream_poll", self._defaults["stream_poll"])
+        self.max_memory = cfg["convert"].get("max_memory", self._defaults["max_memory"])
+        self.shard_by_run = cfg["convert"].get("shard_by_run", self._defaults["shard_by_run"])
+        self.max_open_runs = cfg["convert"].get("max_open_runs", self._defaults["max_open_runs"])
+        self.async_write = cfg["convert"].get("async_write", self._defaults["async_write"])
+        self.imt = cfg["convert"].get("imt", self._defaults["imt"])
+        self.catalog = cfg["convert"].get("catalog", self._defaults["catalog"])
+        self.catalog_deep = cfg["convert"].get("catalog_deep", self._defaults["catalog_deep"])
+        self.queue = cfg["convert"].get("queue", self._defaults["queue"])
+        self.queue_workers = cfg["convert"].get("queue_workers", self._defaults["queue_workers"])
+        self.queue_ttl = cfg["convert"].get("queue_ttl", self._defaults["queue_ttl"])
+        self.queue_max_attempts = cfg["convert"].get("queue_max_attempts", self._defaults["queue_max_attempts"])
+        self.service = cfg["convert"].get("service", self._defaults["service"])
+        self.service_spool = cfg["convert"].get("service_spool", self._defaults["service_spool"])
+        self.service_idle_timeout = cfg["convert"].get("service_idle_timeout", self._defaults["service_idle_timeout"])
 
         self.converter = self.base_path / "bin" / "converter"
+        self.catalog_tool = self.base_path / "bin" / "ao2dcatalog"
+        self.catalog_file = f"{self.output}/catalog.tsv" if self.catalog else None
+        if self.catalog and self.stream:
+            log.warning("The catalog needs the complete filelist, not used while streaming from the downloader.")
+            self.catalog_file = None
+        self.queue_dir = f"{self.output}/queue"
+        if self.queue and self.stream:
+            log.warning("The work queue needs the complete filelist, not used while streaming from the downloader.")
+            self.queue = False
 
         log.info( "Converter configuration:")
         log.info(f"  Converter executable: {self.converter}")
@@ -64,11 +157,39 @@ class Converter:
         log.info(f"  Tree name: {self.tree_name}")
         log.info(f"  Test mode: {self.is_test}")
         log.info(f"  Save clusters: {self.save_clusters}")
+        log.info(f"  Create QA histograms: {self.create_histograms}")
         log.info(f"  Number of AO2Ds per tree: {self.naod}")
         log.info(f"  ROOT package: {self.root_spec}")
         log.info(f"  Email: {self.email}")
         log.info(f"  Recompile converter: {self.recompile}")
         log.info(f"  Verbosity: {self.verbosity}")
+        log.info(f"  Memory budget: {f'{self.max_memory} MB' if self.max_memory else 'none'}")
+        log.info(f"  Shard output by run: {self.shard_by_run}")
+        if self.shard_by_run:
+            log.info(f"    Maximum open runs: {self.max_open_runs}")
+        log.info(f"  Write output on a separate thread: {self.async_write}")
+        log.info(f"  Implicit multithreading threads: {self.imt or 'off'}")
+        log.info(f"  Catalog of the AO2Ds: {self.catalog_file or 'none'}")
+        if self.catalog_file:
+            log.info(f"    Read every basket: {self.catalog_deep}")
+        log.info(f"  Claim batches from a work queue: {self.queue}")
+        if self.queue:
+            log.info(f"    Queue directory: {self.queue_dir}")
+            log.info(f"    Workers: {self.queue_workers}")
+            log.info(f"    Lease TTL: {self.queue_ttl} s")
+            log.info(f"    Attempts per batch: {self.queue_max_attempts}")
+        log.info(f"  Stage inputs to local disk: {self.staging}")
+        if self.staging:
+            log.info(f"    Staging directory: {self.staging_dir or '$TMPDIR'}")
+            log.info(f"    Staging budget: {self.staging_budget} GB")
+            log.info(f"    Files staged ahead: {self.staging_prefetch}")
+        log.info(f"  Use converter service: {self.service}")
+        if self.service:
+            log.info(f"    Spool directory: {self.service_spool or '$TMPDIR/converter_service_$USER'}")
+            log.info(f"    Idle timeout: {self.service_idle_timeout} s")
+        log.info(f"  Stream from downloader: {self.stream}")
+        if self.stream:
+            log.info(f"    Polling interval: {self.stream_poll} s")
         log.info( "  Conversion settings:")
         categories = [category for category in ['event_cuts', 'track_cuts', 'cluster_cuts'] if category in cfg['convert']]
         for category in categories:
@@ -77,13 +198,13 @@ class Converter:
             for param, value in settings.items():
                 log.info(f"      {param}: {value}")
 
-        if not self.converter.is_file():
+        if not self.converter.is_file() or (self.catalog_file and not self.catalog_tool.is_file()):
             log.warning("Converter executable does not exist, compiling now.")
             self.compile_converter()
         elif self.recompile:
             log.warning("Forcing recompilation of converter.")
             self.compile_converter()
-        if not os.path.isfile(self.input):
+        if not self.stream and not os.path.isfile(self.input):
             log.error(f"AO2D filelist at '{self.input}' does not exist!")
             sys.exit(0)
 
@@ -107,6 +228,40 @@ class Converter:
             cfg = yaml.safe_load(stream)
         return cfg
 
+    def scan_catalog(self):
+        """Catalog the AO2Ds once and continue with the filelist of the usable ones."""
+        # reused as long as the filelist has not changed since
+        if os.path.isfile(self.catalog_file) and os.path.getmtime(self.catalog_file) >= os.path.getmtime(self.input):
+            log.info(f"Reusing AO2D catalog: {self.catalog_file}")
+        else:
+            log.info(f"Writing AO2D catalog: {self.catalog_file}")
+            cmd = ("shifter --module=cvmfs --image=tch285/o2alma:latest "
+                  f"/cvmfs/alice.cern.ch/bin/alienv setenv {self.root_spec} -c "
+                  f"{self.catalog_tool} -i {self.input} -o {self.catalog_file}{' --deep' if self.catalog_deep else ''}"
+            )
+            res = subprocess.run(cmd, shell = True)
+            if res.returncode != 0:
+                log.error("AO2D catalog scan failed!")
+                sys.exit(res.returncode)
+
+        files = read_catalog(self.catalog_file)
+        usable = [entry for entry in files if catalog_usable(entry, self.save_clusters)]
+        for entry in files:
+            if not catalog_usable(entry, self.save_clusters):
+                log.warning(f"  Skipping {entry['path']}: {entry['status'] if entry['status'] != 'ok' else 'no usable DF'}")
+        collisions = sum(entry["counts"]["O2jcollision"] or 0 for entry in usable)
+        runs = sorted({run for entry in usable for run in entry["runs"]})
+        gigabytes = sum(entry["bytes"] for entry in usable) / 1024**3
+        log.info(f"Catalog: {len(usable)} of {len(files)} AO2Ds usable, {gigabytes:.1f} GB, {collisions} collisions in {len(runs)} runs")
+        if not usable:
+            log.error("No usable AO2D to convert!")
+            sys.exit(1)
+
+        filelist = f"{self.output}/filelist_catalogued.txt"
+        with open(filelist, 'w') as f:
+            f.writelines(f"{entry['path']}\n" for entry in usable)
+        self.input = filelist
+
     def compile_converter(self):
         cmd = ("shifter --module=cvmfs --image=tch285/o2alma:latest "
               f"/cvmfs/alice.cern.ch/bin/alienv setenv {self.root_spec} -c "
@@ -123,12 +278,97 @@ class Converter:
         else:
             log.info("Running in production mode.")
 
+        if self.stream:
+            self.schedule_stream()
+            return
+
+        if self.catalog_file:
+            self.scan_catalog()
+
         with open(self.input, 'r') as f:
             tot_nfiles = sum(1 for line in f)
         njobs = (tot_nfiles + self.naod - 1) // self.naod
+        if self.queue:
+            # the array tasks are workers draining the batches, instead of one task per batch
+            with open(self.input, 'r') as f:
+                files = [line.strip() for line in f if line.strip()]
+            WorkQueue(self.queue_dir).init(files, self.naod, force = True)
+            njobs = min(self.queue_workers, njobs)
+
+        self.write_convert_script(njobs)
+
+        if self.is_test:
+            log.info("Starting test conversion.")
+            self.run_local(1)
+            log.info("Test conversion succeeded.")
+            self.submit_treelist()
+        else:
+            job_id = subprocess.run(["sbatch", "--parsable", f"{self.output}/convert.sh"], stdout = subprocess.PIPE, stderr = subprocess.PIPE, encoding = "utf-8").stdout.strip()
+            log.info(f"Submitted conversion batch job: ID {job_id}")
+            self.submit_treelist([job_id])
+
+    def schedule_stream(self):
+        """Submit a conversion job for every naod files the downloader publishes."""
+        # the array task ID selects the lines of the filelist to convert, and the
+        # downloader only ever appends to it, so each task's slice is fixed once written
+        self.write_convert_script(1)
+
+        # resume where a previous scheduler left off; the state is the number of tasks
+        # submitted, each with the aligned slice of its task ID. Only the last task, once the
+        # stream is done, can be short, so a resumed scheduler never re-slices the filelist.
+        state_file = f"{self.output}/stream_submitted"
+        ntasks = 0
+        if os.path.isfile(state_file):
+            with open(state_file, 'r') as f:
+                state = f.read().strip()
+            if not state.startswith("tasks:"):
+                log.error(f"Unexpected state in {state_file}: {state}")
+                sys.exit(1)
+            ntasks = int(state.split(":")[1])
+            log.info(f"Resuming streaming conversion after {ntasks} tasks.")
+
+        job_ids = []
+        log.info(f"Waiting for files in: {self.input}")
+        while True:
+            # check for the end of the stream before counting, so no file can be missed
+            done = os.path.isfile(self.stream_done)
+            nready = 0
+            if os.path.isfile(self.input):
+                with open(self.input, 'r') as f:
+                    nready = sum(1 for line in f if line.endswith("\n"))
 
+            while nready >= (ntasks + 1) * self.naod or (done and nready > ntasks * self.naod):
+                task_id = ntasks + 1
+                nfiles = min(self.naod, nready - ntasks * self.naod)
+                log.info(f"{nready} files ready, converting {nfiles} files in task {task_id}.")
+                if self.is_test:
+                    self.run_local(task_id)
+                else:
+                    job_id = subprocess.run(["sbatch", "--parsable", f"--array={task_id}", f"{self.output}/convert.sh"], stdout = subprocess.PIPE, stderr = subprocess.PIPE, encoding = "utf-8").stdout.strip()
+                    log.info(f"Submitted conversion batch job: ID {job_id}")
+                    job_ids.append(job_id)
+                ntasks += 1
+                with open(state_file, 'w') as f:
+                    f.write(f"tasks: {ntasks}\n")
+
+            if done:
+                log.info(f"Download stream finished, {min(nready, ntasks * self.naod)} files in {ntasks} tasks scheduled for conversion.")
+                break
+            time.sleep(self.stream_poll)
+
+        self.submit_treelist(job_ids)
+
+    def write_convert_script(self, njobs):
         notify = f"#SBATCH --mail-type=BEGIN,END\n#SBATCH --mail-user={self.email}" if self.email else ""
         cluster = "--save-clusters" if self.save_clusters else ""
+        histograms = "--create-histograms" if self.create_histograms else ""
+        memory = f"--max-memory={self.max_memory}" if self.max_memory else ""
+        shard = f"--shard-by-run --max-open-runs={self.max_open_runs}" if self.shard_by_run else ""
+        writer = " ".join(opt for opt in ["--async-write" if self.async_write else "",
+                                          f"--imt={self.imt}" if self.imt else ""] if opt)
+        catalog = f"--catalog={self.catalog_file}" if self.catalog_file else ""
+        # one core for the conversion, one for the writer thread and one per IMT thread
+        cpus = 1 + (1 if self.async_write else 0) + (self.imt or 0)
 
         verbosity = ""
         if self.verbosity:
@@ -146,23 +386,42 @@ class Converter:
         contents = contents.replace("{{NFILES_PER_TREE}}", str(self.naod))
         contents = contents.replace("{{TREE_NAME}}", self.tree_name)
         contents = contents.replace("{{CLUSTER_OPT}}", cluster)
+        contents = contents.replace("{{MEMORY_OPT}}", memory)
+        contents = contents.replace("{{SHARD_OPT}}", shard)
+        contents = contents.replace("{{WRITER_OPT}}", writer)
+        contents = contents.replace("{{CATALOG_OPT}}", catalog)
+        contents = contents.replace("{{QUEUE}}", "true" if self.queue else "false")
+        contents = contents.replace("{{QUEUE_DIR}}", self.queue_dir)
+        contents = contents.replace("{{QUEUE_TTL}}", str(self.queue_ttl))
+        contents = contents.replace("{{QUEUE_MAX_ATTEMPTS}}", str(self.queue_max_attempts))
+        contents = contents.replace("{{WORKQUEUE_PATH}}", str(self.base_path / "scripts" / "workqueue.py"))
+        contents = contents.replace("{{CPUS}}", str(cpus))
+        contents = contents.replace("{{HISTOGRAMS_OPT}}", histograms)
         contents = contents.replace("{{CONVERTER_PATH}}", str(self.converter))
         contents = contents.replace("{{VERBOSITY}}", verbosity)
         contents = contents.replace("{{ROOT_PACK}}", self.root_spec)
+        contents = contents.replace("{{STAGING}}", "true" if self.staging else "false")
+        contents = contents.replace("{{STAGING_DIR}}", self.staging_dir or "")
+        contents = contents.replace("{{STAGING_BUDGET}}", str(self.staging_budget))
+        contents = contents.replace("{{STAGING_PREFETCH}}", str(self.staging_prefetch))
+        contents = contents.replace("{{SERVICE}}", "true" if self.service else "false")
+        contents = contents.replace("{{SERVICE_SPOOL}}", self.service_spool or "")
+        contents = contents.replace("{{SERVICE_IDLE_TIMEOUT}}", str(self.service_idle_timeout))
+        contents = contents.replace("{{CLIENT_PATH}}", str(self.base_path / "scripts" / "converter_client.sh"))
 
         with open(f"{self.output}/convert.sh", 'w') as f:
             f.write(contents)
 
-        if self.is_test:
-            log.info("Starting test conversion.")
-            result = subprocess.run(f"/usr/bin/bash {self.output}/convert.sh", shell = True)
-            if result.returncode != 0:
-                log.error("Test conversion crashed, exiting.")
-                sys.exit(result.returncode)
-            log.info("Test conversion succeeded.")
-        else:
-            job_id = subprocess.run(["sbatch", "--parsable", f"{self.output}/convert.sh"], stdout = subprocess.PIPE, stderr = subprocess.PIPE, encoding = "utf-8").stdout.strip()
-            log.info(f"Submitted conversion batch job: ID {job_id}")
+    def run_local(self, task_id):
+        # a local worker converts a single batch of the queue
+        env = dict(os.environ, SLURM_ARRAY_TASK_ID = str(task_id), QUEUE_MAX_BATCHES = "1")
+        result = subprocess.run(f"/usr/bin/bash {self.output}/convert.sh", shell = True, env = env)
+        if result.returncode != 0:
+            log.error("Test conversion crashed, exiting.")
+            sys.exit(result.returncode)
+
+    def submit_treelist(self, job_ids = None):
+        notify = f"#SBATCH --mail-type=BEGIN,END\n#SBATCH --mail-user={self.email}" if self.email else ""
 
         with open(f"{self.base_path}/templates/treelist_nersc.tmpl", 'r') as f:
             contents = f.read()
@@ -172,6 +431,8 @@ class Converter:
         contents = contents.replace("{{TREE_NAME}}", self.tree_name)
         contents = contents.replace("{{ROOT_PACK}}", self.root_spec)
         contents = contents.replace("{{NOTIFY_OPTS}}", notify)
+        contents = contents.replace("{{QUEUE}}", "true" if self.queue else "false")
+        contents = contents.replace("{{QUEUE_DIR}}", self.queue_dir)
 
         with open(f"{self.output}/treelist.sh", 'w') as f:
             f.write(contents)
@@ -184,13 +445,18 @@ class Converter:
                 sys.exit(result.returncode)
             log.info("Treelist creation succeeded.")
         else:
-            job_id = subprocess.run(["sbatch", "--parsable", f"--dependency=afterok:{job_id}", f"{self.output}/treelist.sh"], stdout = subprocess.PIPE, stderr = subprocess.PIPE, encoding = "utf-8").stdout.strip()
+            # queue workers exit with an error when a batch failed for good, the tree list leaves it out and fails
+            condition = "afterany" if self.queue else "afterok"
+            dependency = f"--dependency={condition}:{':'.join(job_ids)}" if job_ids else None
+            cmd = ["sbatch", "--parsable"] + ([dependency] if dependency else []) + [f"{self.output}/treelist.sh"]
+            job_id = subprocess.run(cmd, stdout = subprocess.PIPE, stderr = subprocess.PIPE, encoding = "utf-8").stdout.strip()
             log.info(f"Submitted tree finder batch job: ID {job_id}")
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Convert a list of files', formatter_class=argparse.ArgumentDefaultsHelpFormatter)
     parser.add_argument('-c', '--config', help='Path to the config YAML file.')
+    parser.add_argument('--data-root', default=DATA_ROOT, help='Directory holding all datasets.')
     args = parser.parse_args()
 
-    scheduler = Converter(args.config)
+    scheduler = Converter(args.config, args.data_root)
     scheduler.schedule()
\ No newline at end of file
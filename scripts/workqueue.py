@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+"""Work queue of AO2D batches on a shared filesystem, drained by any number of workers.
+
+The queue is a directory, with one file per batch holding the paths of its AO2Ds:
+
+    pending/<batch>.<attempt>           waiting to be converted
+    leases/<batch>.<attempt>.<worker>   claimed by a worker, which touches it while converting
+    done/<batch>                        converted
+    failed/<batch>                      failed max_attempts times
+
+Every state change is a rename, which is atomic on the filesystem, so there is no
+coordinator and no lock: of several workers renaming the same pending batch, exactly one
+succeeds. A lease that has not been touched for longer than the TTL belongs to a worker
+that crashed or hung, and any worker returns it to pending. Only the standard library is
+used, so that the workers run on the compute nodes outside of the container.
+"""
+
+import argparse
+import collections
+import logging
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import time
+
+log = logging.getLogger('workqueue')
+
+Lease = collections.namedtuple("Lease", ["batch", "attempt", "path"])
+
+class WorkQueue:
+    _defaults = {
+        "ttl": 900,
+        "max_attempts": 3,
+    }
+    _states = ["pending", "leases", "done", "failed"]
+
+    def __init__(self, path, ttl = _defaults["ttl"], max_attempts = _defaults["max_attempts"]):
+        self.path = os.path.abspath(path)
+        self.dirs = {state: os.path.join(self.path, state) for state in self._states}
+        self.ttl = ttl
+        self.max_attempts = max_attempts
+        self.worker = f"{socket.gethostname().split('.')[0]}-{os.getpid()}"
+        self.stopping = False
+
+    def init(self, files, batch_size, force = False):
+        """Split the files into batches of batch_size and queue them."""
+        if os.path.isdir(self.dirs["pending"]) and not force:
+            raise RuntimeError(f"Queue {self.path} already exists, reset it with --force")
+        for state in self._states:
+            shutil.rmtree(self.dirs[state], ignore_errors = True)
+            os.makedirs(self.dirs[state])
+        nbatches = 0
+        for start in range(0, len(files), batch_size):
+            nbatches += 1
+            tmp = os.path.join(self.dirs["pending"], f".{nbatches}.tmp")
+            with open(tmp, 'w') as f:
+                f.writelines(f"{path}\n" for path in files[start:start + batch_size])
+            os.rename(tmp, os.path.join(self.dirs["pending"], f"{nbatches}.0"))
+        log.info(f"Queued {len(files)} files in {nbatches} batches of up to {batch_size}: {self.path}")
+        return nbatches
+
+    def entries(self, state):
+        """Batches in a state, in the order they were queued; files being written start with a dot."""
+        names = [name for name in os.listdir(self.dirs[state]) if not name.startswith('.')]
+        return sorted(names, key = lambda name: int(name.split('.')[0]))
+
+    def now(self):
+        """Current time of the filesystem, which the lease times are compared with, as the clocks of the nodes may differ."""
+        clock = os.path.join(self.path, f".clock-{self.worker}")
+        with open(clock, 'w'):
+            pass
+        now = os.stat(clock).st_mtime
+        os.remove(clock)
+        return now
+
+    def claim(self):
+        """Lease the first pending batch, or None if there is none left."""
+        for name in self.entries("pending"):
+            batch, attempt = name.split('.')
+            pending = os.path.join(self.dirs["pending"], name)
+            lease = os.path.join(self.dirs["leases"], f"{batch}.{attempt}.{self.worker}")
+            try:
+                # the rename keeps the time, which has to be fresh for the lease
+                os.utime(pending)
+                os.rename(pending, lease)
+            except FileNotFoundError:
+                continue # claimed by another worker in between
+            return Lease(batch, int(attempt), lease)
+        return None
+
+    def renew(self, lease):
+        """Touch the lease; False if it was reclaimed in the meantime."""
+        try:
+            os.utime(lease.path)
+            return True
+        except FileNotFoundError:
+            return False
+
+    def retry_or_fail(self, batch, attempt):
+        """Where a batch goes after a failed attempt."""
+        if attempt + 1 < self.max_attempts:
+            return os.path.join(self.dirs["pending"], f"{batch}.{attempt + 1}")
+        return os.path.join(self.dirs["failed"], batch)
+
+    def release(self, lease, destination):
+        """Move the lease out of leases/; False if it was reclaimed in the meantime."""
+        try:
+            os.rename(lease.path, destination)
+            return True
+        except FileNotFoundError:
+            return False
+
+    def reclaim(self):
+        """Return the batches of expired leases to pending, or fail them after max_attempts."""
+        now = self.now()
+        reclaimed = 0
+        for name in self.entries("leases"):
+            lease = os.path.join(self.dirs["leases"], name)
+            try:
+                age = now - os.stat(lease).st_mtime
+            except FileNotFoundError:
+                continue
+            if age < self.ttl:
+                continue
+            batch, attempt, worker = name.split('.', 2)
+            destination = self.retry_or_fail(batch, int(attempt))
+            try:
+                os.rename(lease, destination)
+            except FileNotFoundError:
+                continue # released, or reclaimed by another worker
+            reclaimed += 1
+            log.warning(f"Reclaimed batch {batch} from {worker}, whose lease was not renewed for {age:.0f} s"
+                        f"{'' if destination.startswith(self.dirs['pending']) else ', giving up on it'}")
+        return reclaimed
+
+    def requeue(self):
+        """Queue the failed batches again, with their attempts reset."""
+        names = self.entries("failed")
+        for name in names:
+            os.rename(os.path.join(self.dirs["failed"], name), os.path.join(self.dirs["pending"], f"{name}.0"))
+        log.info(f"Requeued {len(names)} failed batches.")
+        return len(names)
+
+    def status(self):
+        now = self.now()
+        counts = {state: len(self.entries(state)) for state in self._states}
+        log.info(f"Queue {self.path}: {counts['pending']} pending, {counts['leases']} leased, "
+                 f"{counts['done']} done, {counts['failed']} failed")
+        for name in self.entries("leases"):
+            batch, attempt, worker = name.split('.', 2)
+            try:
+                age = now - os.stat(os.path.join(self.dirs["leases"], name)).st_mtime
+            except FileNotFoundError:
+                continue
+            log.info(f"  batch {batch}: {worker}, attempt {int(attempt) + 1}, renewed {age:.0f} s ago"
+                     f"{' (expired)' if age >= self.ttl else ''}")
+        for name in self.entries("failed"):
+            log.info(f"  batch {name}: failed")
+        return counts
+
+    def stop(self, signum, frame):
+        log.warning(f"Received signal {signum}, handing the current batch back.")
+        self.stopping = True
+
+    def convert(self, lease, command, heartbeat):
+        """Run the command on a leased batch, renewing the lease; returns the exit code, or None if the batch was not finished."""
+        env = dict(os.environ, QUEUE_BATCH = lease.batch, QUEUE_FILELIST = lease.path, QUEUE_ATTEMPT = str(lease.attempt))
+        # in its own process group, so that stopping it also stops the converter it starts
+        child = subprocess.Popen(command, env = env, start_new_session = True)
+        while True:
+            try:
+                return child.wait(timeout = heartbeat)
+            except subprocess.TimeoutExpired:
+                pass
+            if self.stopping:
+                reason = "the worker is stopping"
+            elif not self.renew(lease):
+                reason = "its lease was reclaimed by another worker"
+            else:
+                continue
+            log.error(f"Stopping the conversion of batch {lease.batch}, {reason}.")
+            os.killpg(child.pid, signal.SIGTERM)
+            try:
+                child.wait(timeout = 30)
+            except subprocess.TimeoutExpired:
+                os.killpg(child.pid, signal.SIGKILL)
+                child.wait()
+            return None
+
+    def run(self, command, heartbeat = None, max_batches = 0, wait = False):
+        """Claim and convert batches until none is left; returns 1 if a batch failed for good."""
+        heartbeat = heartbeat or self.ttl / 4
+        signal.signal(signal.SIGTERM, self.stop)
+        signal.signal(signal.SIGINT, self.stop)
+        log.info(f"Worker {self.worker} draining {self.path}")
+        converted = failed = 0
+        while not self.stopping and (not max_batches or converted + failed < max_batches):
+            self.reclaim()
+            lease = self.claim()
+            if not lease:
+                # with --wait, stay until the batches leased by others are done, in case their worker dies
+                if wait and self.entries("leases"):
+                    time.sleep(heartbeat)
+                    continue
+                break
+            log.info(f"Converting batch {lease.batch}, attempt {lease.attempt + 1}")
+            start = time.time()
+            code = self.convert(lease, command, heartbeat)
+            if code is not None and code != 0 and self.stopping:
+                # the signal stopping the worker, from Slurm at the end of the job, also reached
+                # the command, which may have exited before the worker saw it
+                log.warning(f"Batch {lease.batch} exited with code {code} while the worker was stopping, handing it back.")
+                code = None
+            if code is None:
+                if self.stopping:
+                    # not the fault of the batch, so the attempt does not count
+                    self.release(lease, os.path.join(self.dirs["pending"], f"{lease.batch}.{lease.attempt}"))
+                continue
+            if code == 0:
+                destination = os.path.join(self.dirs["done"], lease.batch)
+            else:
+                destination = self.retry_or_fail(lease.batch, lease.attempt)
+            if not self.release(lease, destination):
+                log.warning(f"Batch {lease.batch} finished after its lease was reclaimed, it is converted again elsewhere.")
+                continue
+            if code == 0:
+                converted += 1
+                log.info(f"Converted batch {lease.batch} in {time.time() - start:.0f} s")
+            elif destination.startswith(self.dirs["pending"]):
+                log.warning(f"Batch {lease.batch} failed with code {code}, queued again.")
+            else:
+                failed += 1
+                log.error(f"Batch {lease.batch} failed with code {code} {self.max_attempts} times, giving up on it.")
+        log.info(f"Worker {self.worker} done: {converted} batches converted, {failed} failed")
+        return 1 if failed else 0
+
+if __name__ == '__main__':
+    logging.basicConfig(level = logging.INFO, format = '%(asctime)s - %(name)s - %(levelname)s - %(message)s', datefmt = '%Y-%m-%d %H:%M:%S')
+
+    parser = argparse.ArgumentParser(description = 'Work queue of AO2D batches on a shared filesystem.', formatter_class = argparse.ArgumentDefaultsHelpFormatter)
+    parser.add_argument('queue', help = 'Queue directory.')
+    parser.add_argument('--ttl', type = float, default = WorkQueue._defaults["ttl"], help = 'Seconds after which a lease that was not renewed is reclaimed.')
+    parser.add_argument('--max-attempts', type = int, default = WorkQueue._defaults["max_attempts"], help = 'Attempts at a batch before it is failed.')
+    commands = parser.add_subparsers(dest = 'action')
+    commands.required = True
+
+    init = commands.add_parser('init', help = 'Queue the files of a filelist in batches.')
+    init.add_argument('--filelist', required = True, help = 'Text file with one AO2D per line.')
+    init.add_argument('--batch-size', type = int, required = True, help = 'Files per batch.')
+    init.add_argument('--force', action = 'store_true', help = 'Replace an existing queue.')
+
+    run = commands.add_parser('run', help = 'Convert batches until the queue is empty. The command gets the batch in QUEUE_BATCH and its filelist in QUEUE_FILELIST.')
+    run.add_argument('--heartbeat', type = float, default = None, help = 'Seconds between lease renewals (default: a quarter of the TTL).')
+    run.add_argument('--max-batches', type = int, default = 0, help = 'Stop after this many batches, 0 for no limit.')
+    run.add_argument('--wait', action = 'store_true', help = 'Wait for the batches leased by other workers before stopping.')
+    run.add_argument('command', nargs = argparse.REMAINDER, help = 'Command converting a batch, after --.')
+
+    commands.add_parser('status', help = 'Show the batches in each state, the leases and the failed batches.')
+    commands.add_parser('requeue', help = 'Queue the failed batches again.')
+
+    args = parser.parse_args()
+    queue = WorkQueue(args.queue, args.ttl, args.max_attempts)
+    try:
+        if args.action == 'init':
+            with open(args.filelist) as f:
+                files = [line.strip() for line in f if line.strip()]
+            queue.init(files, args.batch_size, args.force)
+        elif args.action == 'run':
+            command = args.command[1:] if args.command[:1] == ['--'] else args.command
+            if not command:
+                parser.error("run needs a command after --")
+            sys.exit(queue.run(command, args.heartbeat, args.max_batches, args.wait))
+        elif args.action == 'status':
+            queue.status()
+        elif args.action == 'requeue':
+            queue.requeue()
+    except (OSError, RuntimeError) as e:
+        log.error(e)
+        sys.exit(1)
@@ -1,136 +1,338 @@
 #include "Converter.hpp"
 
+#include "AsyncWriter.hpp"
+#include "Catalog.hpp"
 #include "EventBuilding.hpp"
+#include "Histograms.hpp"
+#include "RunShards.hpp"
+#include "Summaries.hpp"
+
+#include <chrono>
+#include <filesystem>
 
 #include "TROOT.h"
 #include "TRint.h"
 
+// events per block handed from the conversion to the writing of the tree
+static constexpr size_t blockEvents = 1000;
 
-void Converter::createQAHistos() {
-  hTrackPt = new TH1F("hTrackPt", "Track p_{T}", 100, 0, 100);
-  hClusterEnergy = new TH1F("hClusterEnergy", "Cluster Energy", 100, 0, 100);
-  hClusterEta = new TH1F("hClusterEta", "Cluster #eta", 100, -1, 1);
-  hClusterPhi = new TH1F("hClusterPhi", "Cluster #phi", 100, 0,
-                         2 * /* TMath::Pi()*/ 3.14);
-  hNEvents = new TH1F("hNEvents", "Number of events", 2, 0, 2);
-  hEvtVtxX = new TH1F("hEvtVtxX", "Event vertex x", 100, -10, 10);
-  hEvtVtxY = new TH1F("hEvtVtxY", "Event vertex y", 100, -10, 10);
-  hEvtVtxZ = new TH1F("hEvtVtxZ", "Event vertex z", 100, -10, 10);
-
-  hClusterM02vsE =
-      new TH2F("hClusterM02vsE", "Cluster M02 vs E", 300, 0, 3, 100, 0, 100);
 
+void Converter::createQAHistos() {
   outputhists = new TList();
-  // add them all to histos list
-  outputhists->Add(hTrackPt);
-  outputhists->Add(hClusterEnergy);
-  outputhists->Add(hClusterEta);
-  outputhists->Add(hClusterPhi);
-  outputhists->Add(hNEvents);
-  outputhists->Add(hEvtVtxX);
-  outputhists->Add(hEvtVtxY);
-  outputhists->Add(hEvtVtxZ);
-  outputhists->Add(hClusterM02vsE);
+  histograms = new HistogramManager();
+  histograms->configure(treecuts["convert"]["histograms"]);
+  histograms->book(outputhists);
 }
 
-void Converter::createTree() {
-  outputTree = new TTree("eventTree", "eventTree");
-
-  outputTree->Branch("run_number", &fBuffer_runNumber);
-  outputTree->Branch("multiplicity", &fBuffer_multiplicity);
-  outputTree->Branch("centrality", &fBuffer_centrality);
-  outputTree->Branch("occupancy", &fBuffer_trackOccupancyInTimeRange);
-  outputTree->Branch("vtx_z", &fBuffer_vtxZ);
-  outputTree->Branch("event_sel", &fBuffer_eventSel);
-  outputTree->Branch("trig_sel", &fBuffer_triggerSel);
-  outputTree->Branch("rct", &fBuffer_rct);
-
-  // track
-  outputTree->Branch("track_pt", &fBuffer_track_pt);
-  outputTree->Branch("track_eta", &fBuffer_track_eta);
-  outputTree->Branch("track_phi", &fBuffer_track_phi);
-  outputTree->Branch("track_sel", &fBuffer_track_sel);
-
-  // cluster
-  if (saveClusters) {
-    outputTree->Branch("cluster_energy", &fBuffer_cluster_energy);
-    outputTree->Branch("cluster_eta", &fBuffer_cluster_eta);
-    outputTree->Branch("cluster_phi", &fBuffer_cluster_phi);
-    outputTree->Branch("cluster_m02", &fBuffer_cluster_m02);
-    outputTree->Branch("cluster_m20", &fBuffer_cluster_m20);
-    outputTree->Branch("cluster_ncells", &fBuffer_cluster_ncells);
-    outputTree->Branch("cluster_time", &fBuffer_cluster_time);
-    outputTree->Branch("cluster_exoticity", &fBuffer_cluster_isExotic);
-    outputTree->Branch("cluster_dbc", &fBuffer_cluster_distanceToBadChannel);
-    outputTree->Branch("cluster_nlm", &fBuffer_cluster_nlm);
-    outputTree->Branch("cluster_defn", &fBuffer_cluster_definition);
-    outputTree->Branch("cluster_matched_track_n", &fBuffer_cluster_matchedTrackN);
-    outputTree->Branch("cluster_matched_track_delta_eta", &fBuffer_cluster_matchedTrackDeltaEta);
-    outputTree->Branch("cluster_matched_track_delta_phi", &fBuffer_cluster_matchedTrackDeltaPhi);
-    outputTree->Branch("cluster_matched_track_p", &fBuffer_cluster_matchedTrackP);
-    outputTree->Branch("cluster_matched_track_pt", &fBuffer_cluster_matchedTrackPt);
-    outputTree->Branch("cluster_matched_track_sel", &fBuffer_cluster_matchedTrackSel);
+Converter::Converter(TString outputFilename, const YAML::Node &config, bool createHistograms, bool saveClusters,
+                     long maxMemoryMB, std::string layout, bool shardByRun, int maxOpenRuns, bool asyncWrite,
+                     int imtThreads)
+    : outFile(nullptr), shards(nullptr), writer(nullptr), block(nullptr), createHistograms(createHistograms), saveClusters(saveClusters) {
+  treecuts = config;
+  readConfig();
+  // the command line takes precedence over the config
+  if (layout.empty())
+    layout = treecuts["convert"]["layout"] ? treecuts["convert"]["layout"].as<std::string>() : "vector";
+  if (layout != "vector" && layout != "flat")
+    throw std::runtime_error("Unknown output layout '" + layout + "', expected vector or flat");
+  flatLayout = layout == "flat";
+
+  // with run shards, the given output only keeps the QA histograms, in <name>_histograms.root
+  std::string histFilename = outputFilename.Data();
+  if (shardByRun) {
+    std::filesystem::path path(histFilename);
+    histFilename = (path.parent_path() / (path.stem().string() + "_histograms.root")).string();
+  }
+  if (!shardByRun || createHistograms) {
+    outFile = new TFile(histFilename.c_str(), "RECREATE");
+    if (!outFile || outFile->IsZombie())
+      throw std::runtime_error("Output file " + histFilename + " could not be created");
+  }
+
+  if (createHistograms) {
+    createQAHistos();
+  }
+  allocateBuffers();
+  summaries = new SummaryManager();
+  summaries->configure(treecuts["convert"]["summaries"], saveClusters);
+  // the writer thread and the background closing of run outputs use ROOT concurrently
+  if (shardByRun || asyncWrite)
+    ROOT::EnableThreadSafety();
+  // compresses the baskets of the output in parallel; ROOT keeps the first thread pool
+  // of the process, so it is only enabled when off, and turned off again at the end
+  imtEnabled = imtThreads > 0 && !ROOT::IsImplicitMTEnabled();
+  if (imtEnabled) {
+    ROOT::EnableImplicitMT(imtThreads);
+    logInfo("Implicit multithreading enabled with ", imtThreads, " threads");
+  } else if (imtThreads > 0) {
+    logWarning("Implicit multithreading is already enabled with ", ROOT::GetThreadPoolSize(), " threads, ignoring --imt=", imtThreads);
+  }
+  if (shardByRun) {
+    shards = new RunShards(outputFilename.Data(), maxOpenRuns, [this](OutputTree &out) { bookTree(out); });
+    logInfo("Writing one output per run, with at most ", maxOpenRuns, " open at once");
+  } else {
+    output.file = outFile;
+    bookTree(output);
+  }
+  if (asyncWrite) {
+    writer = new AsyncWriter([this](EventBlock &b) { writeBlock(b); });
+    logInfo("Writing the output on a separate thread");
+  } else {
+    block = new EventBlock();
+  }
+  // the vector branches take over the columns of a block holding a single event, see
+  // writeBlock, so without a writer thread to hand blocks to, events are written one by one
+  eventsPerBlock = writer || flatLayout ? blockEvents : 1;
+  setMemoryBudget(maxMemoryMB);
+}
+
+const ConversionStats &Converter::getStats() {
+  if (writer) writer->flush();
+  if (shards) stats.runs = shards->runs();
+  return stats;
+}
+
+Converter::~Converter() {
+  if (writer) {
+    // the destructor also runs when the conversion failed, in which case the writer may too
+    try {
+      writer->finish();
+    } catch (const std::exception &e) {
+      logError("Writing the output failed: ", e.what());
+    }
+    const WriterStats &ws = writer->getStats();
+    // share of the writing hidden behind the conversion, i.e. not waited for by it
+    double overlap = ws.busySeconds > 0 ? std::max(0., 1 - ws.stallSeconds / ws.busySeconds) : 1;
+    logInfo("Writer: ", ws.blocks, " blocks, busy ", ws.busySeconds, " s, idle ", ws.idleSeconds,
+            " s; conversion stalled on the writer ", ws.stallSeconds, " s; overlap efficiency ", 100 * overlap, "%");
+    delete writer;
+  } else {
+    logInfo("Time spent writing the tree: ", stats.fillSeconds, " s (", flatLayout ? "flat" : "vector", " layout)");
+    delete block;
+  }
+  if (shards) {
+    shards->closeAll();
+    logInfo("Runs written: ", shards->runs());
+    delete shards;
+  } else {
+    outFile->cd();
+    output.tree->Write("", TObject::kOverwrite);
+  }
+  if (createHistograms) {
+    outFile->cd();
+    histograms->merge();
+    outputhists->Write();
+    delete histograms;
+    delete outputhists;
   }
-  // outputTree->SetDirectory(0);
+  if (outFile) {
+    outFile->Close();
+    delete outFile;
+  }
+  delete summaries;
+  // the next conversion of the converter service sets its own
+  if (imtEnabled)
+    ROOT::DisableImplicitMT();
+}
+
+// allocate an output buffer ourselves: a buffer allocated by TTree::Branch is deleted
+// with the tree, which would leave it dangling for the next tree or Converter
+template<class T>
+void allocateBuffer(std::vector<T> *&buffer) {
+  if (!buffer) buffer = new std::vector<T>();
+}
+
+void Converter::allocateBuffers() {
+  allocateBuffer(fBuffer_track_pt);
+  allocateBuffer(fBuffer_track_eta);
+  allocateBuffer(fBuffer_track_phi);
+  allocateBuffer(fBuffer_track_sel);
+  allocateBuffer(fBuffer_cluster_energy);
+  allocateBuffer(fBuffer_cluster_eta);
+  allocateBuffer(fBuffer_cluster_phi);
+  allocateBuffer(fBuffer_cluster_m02);
+  allocateBuffer(fBuffer_cluster_m20);
+  allocateBuffer(fBuffer_cluster_ncells);
+  allocateBuffer(fBuffer_cluster_time);
+  allocateBuffer(fBuffer_cluster_isExotic);
+  allocateBuffer(fBuffer_cluster_distanceToBadChannel);
+  allocateBuffer(fBuffer_cluster_nlm);
+  allocateBuffer(fBuffer_cluster_definition);
+  allocateBuffer(fBuffer_cluster_matchedTrackN);
+  allocateBuffer(fBuffer_cluster_matchedTrackDeltaEta);
+  allocateBuffer(fBuffer_cluster_matchedTrackDeltaPhi);
+  allocateBuffer(fBuffer_cluster_matchedTrackP);
+  allocateBuffer(fBuffer_cluster_matchedTrackPt);
+  allocateBuffer(fBuffer_cluster_matchedTrackSel);
+}
+
+// book the output tree in out.file, or bind the buffers to the tree already in it
+// when a run output is reopened
+void Converter::bookTree(OutputTree &out) {
+  out.file->cd();
+  TTree *tree = (TTree *)out.file->Get("eventTree");
+  bool reopened = tree != nullptr;
+  if (!reopened)
+    tree = new TTree("eventTree", "eventTree");
+  out.tree = tree;
+
+  bindBranch(tree, "run_number", &fBuffer_runNumber);
+  bindBranch(tree, "multiplicity", &fBuffer_multiplicity);
+  bindBranch(tree, "centrality", &fBuffer_centrality);
+  bindBranch(tree, "occupancy", &fBuffer_trackOccupancyInTimeRange);
+  bindBranch(tree, "vtx_z", &fBuffer_vtxZ);
+  bindBranch(tree, "event_sel", &fBuffer_eventSel);
+  bindBranch(tree, "trig_sel", &fBuffer_triggerSel);
+  bindBranch(tree, "rct", &fBuffer_rct);
+
+  if (flatLayout) {
+    bookFlatBranches(out);
+  } else {
+    // track
+    bindBranch(tree, "track_pt", &fBuffer_track_pt);
+    bindBranch(tree, "track_eta", &fBuffer_track_eta);
+    bindBranch(tree, "track_phi", &fBuffer_track_phi);
+    bindBranch(tree, "track_sel", &fBuffer_track_sel);
+
+    // cluster
+    if (saveClusters) {
+      bindBranch(tree, "cluster_energy", &fBuffer_cluster_energy);
+      bindBranch(tree, "cluster_eta", &fBuffer_cluster_eta);
+      bindBranch(tree, "cluster_phi", &fBuffer_cluster_phi);
+      bindBranch(tree, "cluster_m02", &fBuffer_cluster_m02);
+      bindBranch(tree, "cluster_m20", &fBuffer_cluster_m20);
+      bindBranch(tree, "cluster_ncells", &fBuffer_cluster_ncells);
+      bindBranch(tree, "cluster_time", &fBuffer_cluster_time);
+      bindBranch(tree, "cluster_exoticity", &fBuffer_cluster_isExotic);
+      bindBranch(tree, "cluster_dbc", &fBuffer_cluster_distanceToBadChannel);
+      bindBranch(tree, "cluster_nlm", &fBuffer_cluster_nlm);
+      bindBranch(tree, "cluster_defn", &fBuffer_cluster_definition);
+      bindBranch(tree, "cluster_matched_track_n", &fBuffer_cluster_matchedTrackN);
+      bindBranch(tree, "cluster_matched_track_delta_eta", &fBuffer_cluster_matchedTrackDeltaEta);
+      bindBranch(tree, "cluster_matched_track_delta_phi", &fBuffer_cluster_matchedTrackDeltaPhi);
+      bindBranch(tree, "cluster_matched_track_p", &fBuffer_cluster_matchedTrackP);
+      bindBranch(tree, "cluster_matched_track_pt", &fBuffer_cluster_matchedTrackPt);
+      bindBranch(tree, "cluster_matched_track_sel", &fBuffer_cluster_matchedTrackSel);
+    }
+  }
+
+  // summaries
+  summaries->book(tree, reopened);
 }
 
-void Converter::clearBuffers() {
-  fBuffer_track_eta->clear();
-  fBuffer_track_phi->clear();
-  fBuffer_track_pt->clear();
-  fBuffer_track_sel->clear();
+// the flat arrays are bound to the block before each fill; until then, and for columns
+// that never held anything, they point here rather than at null, for which ROOT would
+// allocate arrays of its own
+static Long64_t unbound[1];
+
+// Flat layout: per-event counters and leaf-list arrays sized by them (track_pt[n_tracks]/F, ...),
+// read and written as plain arrays instead of going through the STL collection streamers.
+// The arrays point straight into the columns of the event block, see bindFlatBranches.
+void Converter::bookFlatBranches(OutputTree &out) {
+  TTree *tree = out.tree;
+  bindBranch(tree, "n_tracks", &nTracks, "n_tracks/I");
+  if (saveClusters) {
+    bindBranch(tree, "n_clusters", &nClusters, "n_clusters/I");
+    bindBranch(tree, "n_matched", &nMatched, "n_matched/I");
+  }
+
+  auto array = [&](const char *name, const char *count, const char *type, void *(*data)(EventBlock &, size_t)) {
+    std::string leaflist = std::string(name) + "[" + count + "]/" + type;
+    out.flatBranches.push_back({bindBranch(tree, name, unbound, leaflist.c_str()), data, unbound});
+  };
+#define FLAT_ARRAY(column, begin, count, type) \
+  array(#column, count, type, [](EventBlock &b, size_t i) -> void * { return b.column.data() + b.begin(i); });
+
+  FLAT_ARRAY(track_pt, trackBegin, "n_tracks", "F")
+  FLAT_ARRAY(track_eta, trackBegin, "n_tracks", "F")
+  FLAT_ARRAY(track_phi, trackBegin, "n_tracks", "F")
+  FLAT_ARRAY(track_sel, trackBegin, "n_tracks", "b")
+
+  if (saveClusters) {
+    FLAT_ARRAY(cluster_energy, clusterBegin, "n_clusters", "F")
+    FLAT_ARRAY(cluster_eta, clusterBegin, "n_clusters", "F")
+    FLAT_ARRAY(cluster_phi, clusterBegin, "n_clusters", "F")
+    FLAT_ARRAY(cluster_m02, clusterBegin, "n_clusters", "F")
+    FLAT_ARRAY(cluster_m20, clusterBegin, "n_clusters", "F")
+    FLAT_ARRAY(cluster_ncells, clusterBegin, "n_clusters", "I")
+    FLAT_ARRAY(cluster_time, clusterBegin, "n_clusters", "F")
+    // one byte of 0 or 1 per cluster, as a Bool_t
+    FLAT_ARRAY(cluster_exoticity, clusterBegin, "n_clusters", "O")
+    FLAT_ARRAY(cluster_dbc, clusterBegin, "n_clusters", "F")
+    FLAT_ARRAY(cluster_nlm, clusterBegin, "n_clusters", "I")
+    FLAT_ARRAY(cluster_defn, clusterBegin, "n_clusters", "I")
+    FLAT_ARRAY(cluster_matched_track_n, clusterBegin, "n_clusters", "I")
+    FLAT_ARRAY(cluster_matched_track_delta_eta, matchedBegin, "n_matched", "F")
+    FLAT_ARRAY(cluster_matched_track_delta_phi, matchedBegin, "n_matched", "F")
+    FLAT_ARRAY(cluster_matched_track_p, matchedBegin, "n_matched", "F")
+    FLAT_ARRAY(cluster_matched_track_pt, matchedBegin, "n_matched", "F")
+    FLAT_ARRAY(cluster_matched_track_sel, matchedBegin, "n_matched", "b")
+  }
+#undef FLAT_ARRAY
+}
 
+// set the counters of an event of the block
+void Converter::setFlatCounters(const EventBlock &block, size_t event) {
+  nTracks = block.trackEnd[event] - block.trackBegin(event);
   if (saveClusters) {
-    fBuffer_cluster_energy->clear();
-    fBuffer_cluster_eta->clear();
-    fBuffer_cluster_phi->clear();
-    fBuffer_cluster_m02->clear();
-    fBuffer_cluster_m20->clear();
-    fBuffer_cluster_ncells->clear();
-    fBuffer_cluster_time->clear();
-    fBuffer_cluster_isExotic->clear();
-    fBuffer_cluster_distanceToBadChannel->clear();
-    fBuffer_cluster_nlm->clear();
-    fBuffer_cluster_definition->clear();
-    fBuffer_cluster_matchedTrackN->clear();
-    fBuffer_cluster_matchedTrackDeltaEta->clear();
-    fBuffer_cluster_matchedTrackDeltaPhi->clear();
-    fBuffer_cluster_matchedTrackP->clear();
-    fBuffer_cluster_matchedTrackPt->clear();
-    fBuffer_cluster_matchedTrackSel->clear();
+    nClusters = block.clusterEnd[event] - block.clusterBegin(event);
+    nMatched = block.matchedEnd[event] - block.matchedBegin(event);
+  }
+}
+
+// point the arrays at the entries of an event of the block
+void Converter::bindFlatBranches(OutputTree &out, EventBlock &block, size_t event) {
+  for (auto &fb : out.flatBranches) {
+    void *address = fb.data(block, event);
+    if (!address) address = unbound;
+    if (address != fb.bound) {
+      fb.branch->SetAddress(address);
+      fb.bound = address;
+    }
   }
 }
 
-// write events to TTree
-void Converter::writeEvents(TTree *tree, std::vector<Event> &events) {
+// select events and pack them into blocks, which are written to the output tree, or to the
+// tree of their run, by writeBlock: inline, or on the writer thread with asynchronous writing
+void Converter::writeEvents(std::vector<Event> &events) {
+  // QA histograms are accumulated per thread while writing and merged at the end
+  std::vector<HistAccumulator> *acc = createHistograms ? &histograms->local() : nullptr;
+  bool histTracks = acc && histograms->fills(HistStage::After, HistLevel::Track);
+  bool histClusters = acc && histograms->fills(HistStage::After, HistLevel::Cluster);
+
   for (auto &ev : events) {
-    // clear all buffers
-    clearBuffers();
+    if (acc)
+      histograms->fillBefore(*acc, ev);
 
     if (event_zvtx_cut >= 0 && TMath::Abs(ev.col.posZ) > event_zvtx_cut)
       continue;
 
     if (saveClusters && event_clus_E_min >= 0) {
-      bool acc = false;
+      bool accepted = false;
       for (auto &cl : ev.clusters) {
         if (cl.energy > event_clus_E_min) {
-          acc = true;
+          accepted = true;
           break;
         }
       }
-      if (!acc)
+      if (!accepted)
         continue;
     }
 
+    if (acc)
+      histograms->fillEvent(*acc, HistStage::After, ev);
+
+    EventBlock &b = writer ? writer->block() : *block;
+
     // fill event level properties
-    fBuffer_runNumber = (Int_t)ev.col.runNumber;
-    fBuffer_multiplicity = (Float_t)ev.col.multiplicity;
-    fBuffer_centrality = (Float_t)ev.col.centrality;
-    fBuffer_trackOccupancyInTimeRange = (Int_t)ev.col.trackOccupancyInTimeRange;
-    fBuffer_vtxZ = (Float_t)ev.col.posZ;
-    fBuffer_eventSel = (UShort_t)ev.col.eventSel;
-    fBuffer_triggerSel = (ULong64_t)ev.col.triggerSel;
-    fBuffer_rct = (UInt_t)ev.col.rct;
+    b.runNumber.push_back((Int_t)ev.col.runNumber);
+    b.multiplicity.push_back((Float_t)ev.col.multiplicity);
+    b.centrality.push_back((Float_t)ev.col.centrality);
+    b.occupancy.push_back((Int_t)ev.col.trackOccupancyInTimeRange);
+    b.vtxZ.push_back((Float_t)ev.col.posZ);
+    b.eventSel.push_back((UShort_t)ev.col.eventSel);
+    b.triggerSel.push_back((ULong64_t)ev.col.triggerSel);
+    b.rct.push_back((UInt_t)ev.col.rct);
 
     // fill track properties
     for (auto &tr : ev.tracks) {
@@ -141,10 +343,12 @@ void Converter::writeEvents(TTree *tree, std::vector<Event> &events) {
       if (tr.eta > track_eta_max)
         continue;
 
-      fBuffer_track_eta->push_back((Float_t)tr.eta);
-      fBuffer_track_phi->push_back((Float_t)tr.phi);
-      fBuffer_track_pt->push_back((Float_t)tr.pt);
-      fBuffer_track_sel->push_back((UChar_t)tr.trackSel);
+      b.track_eta.push_back((Float_t)tr.eta);
+      b.track_phi.push_back((Float_t)tr.phi);
+      b.track_pt.push_back((Float_t)tr.pt);
+      b.track_sel.push_back((UChar_t)tr.trackSel);
+      if (histTracks)
+        histograms->fillTrack(*acc, HistStage::After, tr);
     }
 
     // fill cluster properties
@@ -154,54 +358,121 @@ void Converter::writeEvents(TTree *tree, std::vector<Event> &events) {
           continue;
         if (cluster_definition >= 0 && cl.definition != cluster_definition)
           continue;
-        fBuffer_cluster_energy->push_back((Float_t)cl.energy);
-        fBuffer_cluster_eta->push_back((Float_t)cl.eta);
-        fBuffer_cluster_phi->push_back((Float_t)cl.phi);
-        fBuffer_cluster_m02->push_back((Float_t)cl.m02);
-        fBuffer_cluster_m20->push_back((Float_t)cl.m20);
-        fBuffer_cluster_ncells->push_back((Int_t)cl.ncells);
-        fBuffer_cluster_time->push_back((Float_t)cl.time);
-        fBuffer_cluster_isExotic->push_back((Bool_t)cl.isExotic);
-        fBuffer_cluster_distanceToBadChannel->push_back(
-            (Float_t)cl.distanceToBadChannel);
-        fBuffer_cluster_nlm->push_back((Int_t)cl.nlm);
-        fBuffer_cluster_definition->push_back((Int_t)cl.definition);
-        fBuffer_cluster_matchedTrackN->push_back((Int_t)cl.matchedTrackN);
-        fBuffer_cluster_matchedTrackDeltaEta->insert(fBuffer_cluster_matchedTrackDeltaEta->end(), cl.matchedTrackDeltaEta.begin(), cl.matchedTrackDeltaEta.end());
-        fBuffer_cluster_matchedTrackDeltaPhi->insert(fBuffer_cluster_matchedTrackDeltaPhi->end(), cl.matchedTrackDeltaPhi.begin(), cl.matchedTrackDeltaPhi.end());
-        fBuffer_cluster_matchedTrackP->insert(fBuffer_cluster_matchedTrackP->end(), cl.matchedTrackP.begin(), cl.matchedTrackP.end());
-        fBuffer_cluster_matchedTrackPt->insert(fBuffer_cluster_matchedTrackPt->end(), cl.matchedTrackPt.begin(), cl.matchedTrackPt.end());
-        fBuffer_cluster_matchedTrackSel->insert(fBuffer_cluster_matchedTrackSel->end(), cl.matchedTrackSel.begin(), cl.matchedTrackSel.end());
+        b.cluster_energy.push_back((Float_t)cl.energy);
+        b.cluster_eta.push_back((Float_t)cl.eta);
+        b.cluster_phi.push_back((Float_t)cl.phi);
+        b.cluster_m02.push_back((Float_t)cl.m02);
+        b.cluster_m20.push_back((Float_t)cl.m20);
+        b.cluster_ncells.push_back((Int_t)cl.ncells);
+        b.cluster_time.push_back((Float_t)cl.time);
+        b.cluster_exoticity.push_back((UChar_t)cl.isExotic);
+        b.cluster_dbc.push_back((Float_t)cl.distanceToBadChannel);
+        b.cluster_nlm.push_back((Int_t)cl.nlm);
+        b.cluster_defn.push_back((Int_t)cl.definition);
+        b.cluster_matched_track_n.push_back((Int_t)cl.matchedTrackN);
+        b.cluster_matched_track_delta_eta.insert(b.cluster_matched_track_delta_eta.end(), cl.matchedTrackDeltaEta.begin(), cl.matchedTrackDeltaEta.end());
+        b.cluster_matched_track_delta_phi.insert(b.cluster_matched_track_delta_phi.end(), cl.matchedTrackDeltaPhi.begin(), cl.matchedTrackDeltaPhi.end());
+        b.cluster_matched_track_p.insert(b.cluster_matched_track_p.end(), cl.matchedTrackP.begin(), cl.matchedTrackP.end());
+        b.cluster_matched_track_pt.insert(b.cluster_matched_track_pt.end(), cl.matchedTrackPt.begin(), cl.matchedTrackPt.end());
+        b.cluster_matched_track_sel.insert(b.cluster_matched_track_sel.end(), cl.matchedTrackSel.begin(), cl.matchedTrackSel.end());
+        if (histClusters)
+          histograms->fillCluster(*acc, HistStage::After, cl);
       }
     }
 
-    // fill tree
-    tree->Fill();
+    b.endEvent();
+    stats.written++;
+    if (b.size() >= eventsPerBlock)
+      submitBlock();
   }
+  // the events are released after this, and the block would otherwise wait for the next chunk
+  submitBlock();
 }
 
-// can be used to do analysis (if needed)
-void Converter::doAnalysis(std::vector<Event> &events) {
-  for (auto &ev : events) {
-    hNEvents->Fill(1);
-    hEvtVtxX->Fill(ev.col.posX);
-    hEvtVtxY->Fill(ev.col.posY);
-    hEvtVtxZ->Fill(ev.col.posZ);
+// hand the filled block over to be written
+void Converter::submitBlock() {
+  if (writer) {
+    writer->submit();
+  } else if (block->size()) {
+    writeBlock(*block);
+    block->clear();
+  }
+}
 
-    // plot pt of all tracks
-    for (auto &tr : ev.tracks) {
-      hTrackPt->Fill(tr.pt);
-    }
+// Hand a column of a block holding a single event to its output buffer and back, by
+// swapping, so the vector branch writes the column itself. std::vector<bool> is packed
+// and cannot take the column over, the exoticity flags are copied.
+template<class T>
+void exchangeColumn(std::vector<T> *buffer, std::vector<T> &column, bool /*lend*/) {
+  buffer->swap(column);
+}
+
+inline void exchangeColumn(std::vector<Bool_t> *buffer, std::vector<UChar_t> &column, bool lend) {
+  if (lend) buffer->assign(column.begin(), column.end());
+}
 
-    // plot energy, eta and phi of all clusters
-    for (auto &cl : ev.clusters) {
-      hClusterEnergy->Fill(cl.energy);
-      hClusterEta->Fill(cl.eta);
-      hClusterPhi->Fill(cl.phi);
+// fill the tree with the events of a block one by one: the flat arrays point into the
+// columns of the block; the vector branches take the columns over when the block holds
+// a single event, and otherwise, i.e. on the writer thread, get copies of the entries
+// of each event
+void Converter::writeBlock(EventBlock &block) {
+  bool summarize = !summaries->empty();
+  bool lend = !flatLayout && block.size() == 1;
+  auto fillStart = std::chrono::steady_clock::now();
+
+  auto exchange = [&](bool lending) {
+#define EXCHANGE_ARRAY(type, name, buffer) exchangeColumn(buffer, block.name, lending);
+    TRACK_COLUMNS_DO(EXCHANGE_ARRAY)
+    if (saveClusters) {
+      CLUSTER_COLUMNS_DO(EXCHANGE_ARRAY)
+      MATCHED_COLUMNS_DO(EXCHANGE_ARRAY)
+    }
+#undef EXCHANGE_ARRAY
+  };
+
+  for (size_t i = 0; i < block.size(); i++) {
+#define LOAD_SCALAR(type, name, buffer) buffer = block.name[i];
+    EVENT_COLUMNS_DO(LOAD_SCALAR)
+#undef LOAD_SCALAR
+    // from the block, before its columns are lent out
+    if (summarize)
+      summaries->compute(block, i);
+
+    if (lend) {
+      exchange(true);
+    } else if (!flatLayout) {
+      size_t trackBegin = block.trackBegin(i), clusterBegin = block.clusterBegin(i), matchedBegin = block.matchedBegin(i);
+      size_t trackEnd = block.trackEnd[i], clusterEnd = block.clusterEnd[i], matchedEnd = block.matchedEnd[i];
+#define LOAD_ARRAY(from, to, type, name, buffer) \
+      buffer->assign(block.name.begin() + from, block.name.begin() + to);
+#define LOAD_TRACK(type, name, buffer) LOAD_ARRAY(trackBegin, trackEnd, type, name, buffer)
+#define LOAD_CLUSTER(type, name, buffer) LOAD_ARRAY(clusterBegin, clusterEnd, type, name, buffer)
+#define LOAD_MATCHED(type, name, buffer) LOAD_ARRAY(matchedBegin, matchedEnd, type, name, buffer)
+      TRACK_COLUMNS_DO(LOAD_TRACK)
+      if (saveClusters) {
+        CLUSTER_COLUMNS_DO(LOAD_CLUSTER)
+        MATCHED_COLUMNS_DO(LOAD_MATCHED)
+      }
+#undef LOAD_ARRAY
+#undef LOAD_TRACK
+#undef LOAD_CLUSTER
+#undef LOAD_MATCHED
+    }
 
-      hClusterM02vsE->Fill(cl.m02, cl.energy);
+    OutputTree &out = shards ? shards->get(fBuffer_runNumber) : output;
+    if (flatLayout) {
+      setFlatCounters(block, i);
+      bindFlatBranches(out, block, i);
     }
+
+    // fill tree
+    out.tree->Fill();
+
+    // the block keeps its columns, and their capacity, for the next event
+    if (lend)
+      exchange(false);
   }
+  stats.fillSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - fillStart).count();
 }
 
 void Converter::readConfig() {
@@ -255,7 +526,43 @@ void Converter::readConfig() {
   logInfo("Cluster energy minimum: ", cluster_E_min);
 }
 
-void Converter::processFile(TFile *file) {
+void Converter::setMemoryBudget(long maxMemoryMB) {
+  maxMemory = maxMemoryMB * (size_t(1) << 20);
+  eventMemory = 0;
+  if (!maxMemory) return;
+  // whatever is resident once ROOT is up and the output is booked is not available to events
+  size_t baseline = currentRSS();
+  if (baseline + maxMemory / 10 > maxMemory) {
+    eventMemory = maxMemory / 10;
+    logWarning("Memory budget of ", maxMemoryMB, " MB is barely above the baseline of ", baseline >> 20,
+               " MB, building at most ", eventMemory >> 20, " MB of events at a time");
+  } else {
+    eventMemory = maxMemory - baseline;
+    logInfo("Memory budget: ", maxMemoryMB, " MB, of which ", eventMemory >> 20, " MB for events");
+  }
+}
+
+void Converter::skipFile(const CatalogFile &entry) {
+  logWarning("Skipping ", entry.path, ": ", entry.status == "ok" ? "no usable dataframe" : entry.status);
+  stats.skippedFiles++;
+}
+
+void Converter::presize(const Catalog &catalog) {
+  CatalogCounts totals = catalog.totals(saveClusters);
+  if (totals.collisions <= 0) return;
+  // per event averages over the catalog, with about one matched track per cluster
+  auto perBlock = [&](int64_t entries) { return entries > 0 ? size_t(entries * eventsPerBlock / totals.collisions) : 0; };
+  size_t tracks = perBlock(totals.tracks);
+  size_t clusters = saveClusters ? perBlock(totals.clusters) : 0;
+  size_t matched = saveClusters ? perBlock(totals.clusterTracks) : 0;
+  if (writer)
+    writer->reserve(eventsPerBlock, tracks, clusters, matched);
+  else
+    block->reserve(eventsPerBlock, tracks, clusters, matched);
+  logInfo("Event blocks sized for ", eventsPerBlock, " events with ", tracks, " tracks and ", clusters, " clusters");
+}
+
+void Converter::processFile(TFile *file, const CatalogFile *entry) {
   std::vector<Event> events;
   int totalNumberOfEvents = 0;
   // loop over all directories and print name
@@ -266,6 +573,12 @@ void Converter::processFile(TFile *file) {
     TClass *cl = gROOT->GetClass(key->GetClassName());
     if (!cl->InheritsFrom("TDirectory"))
       continue;
+    const CatalogDF *df = entry ? entry->df(key->GetName()) : nullptr;
+    if (df && !df->usable(saveClusters)) {
+      logWarning("   Skipping dataframe ", key->GetName(), ": ", df->status == "ok" ? "missing tables" : df->status);
+      stats.skippedDataframes++;
+      continue;
+    }
     logInfo("   Converting dataframe: ", key->GetName());
     TDirectory *dir = (TDirectory *)key->ReadObj();
 
@@ -291,24 +604,34 @@ void Converter::processFile(TFile *file) {
     TTree *O2jbc = (TTree *)dir->Get("O2jbc");
     if (!O2jbc) throw std::runtime_error("TTree O2jbc could not be found in file.");
 
-    // build event
-    events =
-        buildEvents(O2jcollision, O2jbc, O2jtrack, O2jcluster, O2jclustertrack, O2jemctrack, saveClusters);
+    // oversized DFs are built in chunks of collisions to stay within the memory budget
+    std::vector<CollisionChunk> chunks =
+        planChunks(O2jcollision, O2jtrack, O2jcluster, (TTree *)dir->Get("O2jemctrack"), saveClusters, eventMemory);
 
-    logDebug("Event size: ", events.size());
-    totalNumberOfEvents += events.size();
+    EMCALMatches *matches = saveClusters ? new EMCALMatches(O2jemctrack, chunks.size() > 1) : nullptr;
 
-    if (createHistograms)
-      doAnalysis(events);
+    for (auto &chunk : chunks) {
+      // build event
+      events =
+          buildEvents(O2jcollision, O2jbc, O2jtrack, O2jcluster, O2jclustertrack, matches, saveClusters, chunk);
 
-    // write events to TTree
-    writeEvents(outputTree, events);
+      logDebug("Event size: ", events.size());
+      totalNumberOfEvents += events.size();
 
-    // delete all events
-    events.clear();
+      // write events to TTree, filling the QA histograms on the way
+      writeEvents(events);
+
+      // delete all events and give the memory back before the next chunk
+      std::vector<Event>().swap(events);
+    }
+    delete matches;
+    delete O2jclustertrack;
+    delete O2jemctrack;
     count++;
   }
 
   logInfo("Total DFs: ", count);
   logInfo("Total events: ", totalNumberOfEvents);
+  stats.dataframes += count;
+  stats.events += totalNumberOfEvents;
 }
@@ -1,35 +1,122 @@
 #include <TFile.h>
 #include <TString.h>
 
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
 #include "ArgumentParser.hpp"
+#include "Catalog.hpp"
+#include "ConversionService.hpp"
 #include "Converter.hpp"
 #include "logger.hpp"
 
-void convertAO2DtoAOD(TString inputFilelist = "",
-                      TString outputFilename = "output/test.root",
-                      TString configFile = "treeCuts.yaml",
-                      bool createHistograms = false,
-                      bool saveClusters = false
-                    ) {
+// wait for the job script to finish copying a file to node-local disk
+void waitForStagedFile(const std::string &path, int timeout = 3600) {
+  int waited = 0;
+  while (!std::filesystem::exists(path)) {
+    if (waited >= timeout)
+      throw std::runtime_error("Staged file " + path + " did not appear after " + std::to_string(timeout) + " s");
+    if (waited % 60 == 0) logInfo("   Waiting for staged file ", path);
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    waited++;
+  }
+}
 
-  // loop over all files in txt file filelist
+std::vector<TString> readFilelist(const std::string &filename) {
   std::vector<TString> filelist;
-  std::ifstream file(inputFilelist.Data());
+  std::ifstream file(filename);
+  if (!file.is_open()) throw std::runtime_error("Input file list " + filename + " could not be read");
   std::string str;
   while (std::getline(file, str)) {
     filelist.push_back(str);
   }
+  return filelist;
+}
+
+ConversionStats convertAO2DtoAOD(TString inputFilelist,
+                      TString outputFilename,
+                      const YAML::Node &config,
+                      bool createHistograms = false,
+                      bool saveClusters = false,
+                      bool stagedInput = false,
+                      long maxMemory = 0,
+                      std::string layout = "",
+                      bool shardByRun = false,
+                      int maxOpenRuns = 16,
+                      bool asyncWrite = false,
+                      int imtThreads = 0,
+                      std::string catalogFile = "",
+                      std::string originalFilelist = ""
+                    ) {
+
+  // loop over all files in txt file filelist
+  std::vector<TString> filelist = readFilelist(inputFilelist.Data());
+  // staged copies are renamed, so they are looked up in the catalog under the path of the
+  // file they were copied from, on the same line of the original list
+  std::vector<TString> originals;
+  if (!originalFilelist.empty()) {
+    originals = readFilelist(originalFilelist);
+    if (originals.size() != filelist.size())
+      throw std::runtime_error("Original file list " + originalFilelist + " has " + std::to_string(originals.size()) +
+                               " files, the input file list " + std::to_string(filelist.size()));
+  }
 
-  Converter c(outputFilename.Data(), configFile.Data(), createHistograms, saveClusters);
+  Converter c(outputFilename.Data(), config, createHistograms, saveClusters, maxMemory, layout, shardByRun, maxOpenRuns, asyncWrite,
+                imtThreads);
+
+  // files and DFs marked as unusable by the catalog are skipped, and the blocks are sized from it
+  Catalog catalog;
+  if (!catalogFile.empty()) {
+    catalog = Catalog::read(catalogFile);
+    logInfo("Catalog ", catalogFile, ": ", catalog.getFiles().size(), " files");
+    c.presize(catalog);
+  }
 
   for (size_t i = 0; i < filelist.size(); i++) {
     TString filePath = filelist.at(i);
+    if (stagedInput) waitForStagedFile(filePath.Data());
+    const CatalogFile *entry = catalog.find(originals.empty() ? filePath.Data() : originals.at(i).Data());
+    if (entry && !entry->usable(saveClusters)) {
+      c.skipFile(*entry);
+      if (stagedInput) std::filesystem::remove(filePath.Data());
+      continue;
+    }
     std::cout << "-> Processing file " << filePath << std::endl;
-    TFile *in = new TFile(filePath.Data());
-    if (!in) std::runtime_error("TFile " + filePath + "not found!");
-    c.processFile(in);
+    TFile *in = TFile::Open(filePath.Data());
+    if (!in || in->IsZombie())
+      throw std::runtime_error("TFile " + std::string(filePath.Data()) + " could not be opened");
+    if (in->TestBit(TFile::kRecovered)) logWarning("   ", filePath, " was not closed properly, converting the recovered keys");
+    c.processFile(in, entry);
     in->Close();
+    delete in;
+    // free the local disk budget for the next staged file
+    if (stagedInput) std::filesystem::remove(filePath.Data());
+  }
+  const ConversionStats &stats = c.getStats();
+  if (!catalogFile.empty())
+    logInfo("Skipped ", stats.skippedFiles, " unusable files and ", stats.skippedDataframes, " unusable dataframes");
+  return stats;
+}
+
+// conversion of a request sent to the converter service
+YAML::Node serveRequest(const ConversionRequest &req, const YAML::Node &config) {
+  ConversionStats stats = convertAO2DtoAOD(req.inputFilelist, req.outputFilename, config,
+                                           req.createHistograms, req.saveClusters, req.stagedInput, req.maxMemory, req.layout,
+                                           req.shardByRun, req.maxOpenRuns, req.asyncWrite, req.imtThreads, req.catalog,
+                                           req.originalFilelist);
+  YAML::Node answer;
+  answer["output"] = req.outputFilename;
+  answer["dataframes"] = stats.dataframes;
+  answer["events"] = stats.events;
+  answer["written"] = stats.written;
+  answer["fill_seconds"] = stats.fillSeconds;
+  if (req.shardByRun) answer["runs"] = stats.runs;
+  if (!req.catalog.empty()) {
+    answer["skipped_files"] = stats.skippedFiles;
+    answer["skipped_dataframes"] = stats.skippedDataframes;
   }
+  return answer;
 }
 
 int main(int argc, char **argv) {
@@ -37,15 +124,32 @@ int main(int argc, char **argv) {
   try {
     ArgumentParser parser;
     parser.parse(argc, argv);
+    if (!parser.serveDir.empty()) {
+      ConversionService service(parser.serveDir, parser.idleTimeout);
+      return service.run(serveRequest);
+    }
     convertAO2DtoAOD(
         /*inputFilelist = */ parser.inputFilelist,
         /*outputFilename = */ parser.outputFilename,
-        /*configFile = */ parser.configFile,
+        /*config = */ YAML::LoadFile(parser.configFile),
         /*createHistograms = */ parser.createHistograms,
-        /*saveClusters = */ parser.saveClusters);
+        /*saveClusters = */ parser.saveClusters,
+        /*stagedInput = */ parser.stagedInput,
+        /*maxMemory = */ parser.maxMemory,
+        /*layout = */ parser.layout,
+        /*shardByRun = */ parser.shardByRun,
+        /*maxOpenRuns = */ parser.maxOpenRuns,
+        /*asyncWrite = */ parser.asyncWrite,
+        /*imtThreads = */ parser.imtThreads,
+        /*catalogFile = */ parser.catalogFile,
+        /*originalFilelist = */ parser.originalFilelist);
   } catch (int code) {
     std::cout << "Exception caught: " << code << std::endl;
     return code;
+  } catch (const std::exception &e) {
+    // the Converter is destroyed on the way, which closes the output
+    logError("Conversion failed: ", e.what());
+    return 1;
   }
   return 0;
 }
@@ -0,0 +1,133 @@
+#!/usr/bin/bash
+
+# Regression checks of the converter, run by `make check`. Everything runs offline on a
+# synthetic AO2D written by treecheck:
+#  - the conversion of the fixture must match the golden output, written by the reference
+#    converter from before the optimizations (see tests/make_golden.sh);
+#  - the conversions with the flat layout, asynchronous writing, chunked building, run
+#    sharding and a catalog must match the reference conversion, histograms included;
+#  - several local workers must drain a work queue, see tests/workqueue.sh;
+#  - the throughput and peak memory of a larger conversion must not regress beyond the
+#    tolerance against the reference converter, timed on this machine in the same run.
+# The golden output and the performance baseline are written anew by every run, so that
+# nothing has to be stored; a reference converter that cannot be built fails the checks.
+
+project_root="$( realpath "$(dirname -- "${BASH_SOURCE[0]}")/.." )"
+. "$project_root/scripts/util.sh"
+
+show_help() {
+    cat << EOF
+Usage: tests/check.sh [OPTIONS]
+
+Options:
+  --no-perf            Skip the performance gate
+  --tolerance <x>      Allowed throughput and peak memory regression (default: 0.2)
+  -h, --help           Show this help message
+EOF
+}
+
+perf=true
+tolerance=0.2
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --no-perf) perf=false; shift ;;
+        --tolerance) tolerance="$2"; shift 2 ;;
+        -h|--help) show_help; exit 0 ;;
+        *) error "Unknown option: $1"; show_help; exit 2 ;;
+    esac
+done
+
+converter="$project_root/bin/converter"
+treecheck="$project_root/bin/treecheck"
+ao2dcatalog="$project_root/bin/ao2dcatalog"
+config="$project_root/tests/config.yaml"
+reference_converter="$project_root/obj/golden/src/bin/converter"
+work="$project_root/obj/check"
+golden="$work/golden/BerkeleyTree.root"
+baseline="$work/perf_baseline.yaml"
+
+check_cmd "$converter"
+check_cmd "$treecheck"
+check_cmd "$ao2dcatalog"
+rm -rf "$work"
+mkdir -p "$work"
+
+failures=0
+fail() { error "$*"; failures=$(( failures + 1 )); }
+
+# convert <name> [converter options], into $work/<name>/BerkeleyTree.root
+convert() {
+    local name="$1"; shift
+    mkdir -p "$work/$name"
+    if ! "$converter" -i "$work/fixture.txt" -o "$work/$name/BerkeleyTree.root" -c "$config" \
+            --save-clusters --create-histograms "$@" > "$work/$name/converter.log" 2>&1; then
+        fail "Conversion '$name' failed, see $work/$name/converter.log"
+        return 1
+    fi
+}
+
+# compare <name> <reference> [treecheck options]
+compare() {
+    local name="$1" reference="$2"; shift 2
+    local output="$work/$name/BerkeleyTree.root"
+    # run shards and their histograms are compared together
+    if [ ! -f "$output" ]; then
+        find "$work/$name" -name '*.root' | sort > "$work/$name/outputs.txt"
+        output="$work/$name/outputs.txt"
+    fi
+    if "$treecheck" compare "$reference" "$output" "$@"; then
+        info "Conversion '$name' matches $(basename "$(dirname "$reference")")/$(basename "$reference")"
+    else
+        fail "Conversion '$name' differs from $reference"
+    fi
+}
+
+info "Writing the fixture"
+"$treecheck" make-fixture "$work/fixture.root" --dataframes=6 --collisions=400 || exit 1
+echo "$work/fixture.root" > "$work/fixture.txt"
+
+convert reference || exit 1
+reference="$work/reference/BerkeleyTree.root"
+if ! "$project_root/tests/make_golden.sh" "$work/fixture.txt" "$golden"; then
+    fail "No golden output, the reference converter could not convert the fixture"
+else
+    # the golden output has neither the QA histograms nor the summaries
+    compare reference "$golden" --no-histograms --ignore=leading_track_pt,n_clusters_above_1
+fi
+
+convert flat --layout=flat && compare flat "$reference" --ignore=n_tracks,n_clusters,n_matched
+convert async --async-write --imt=2 && compare async "$reference"
+convert chunked --max-memory=1 && compare chunked "$reference"
+convert sharded --shard-by-run --max-open-runs=2 && compare sharded "$reference"
+if "$ao2dcatalog" -i "$work/fixture.txt" -o "$work/catalog.tsv" > "$work/catalog.log" 2>&1; then
+    convert catalog --catalog="$work/catalog.tsv" && compare catalog "$reference"
+else
+    fail "Catalog scan failed, see $work/catalog.log"
+fi
+
+if "$project_root/tests/workqueue.sh" > "$work/workqueue.log" 2>&1; then
+    info "Work queue drained"
+else
+    fail "Work queue check failed, see $work/workqueue.log"
+fi
+
+if $perf; then
+    info "Writing the performance fixture"
+    "$treecheck" make-fixture "$work/perf_fixture.root" --dataframes=8 --collisions=5000 --seed=2 || exit 1
+    echo "$work/perf_fixture.root" > "$work/perf_fixture.txt"
+    perf_opts=(-i "$work/perf_fixture.txt" -o "$work/perf.root" -c "$config" --save-clusters --create-histograms)
+    info "Timing the reference converter"
+    if [ ! -x "$reference_converter" ] || ! "$treecheck" perf --input="$work/perf_fixture.root" --baseline="$baseline" \
+            --update -- "$reference_converter" "${perf_opts[@]}"; then
+        fail "No performance baseline, the reference converter could not convert the performance fixture"
+    elif ! "$treecheck" perf --input="$work/perf_fixture.root" --baseline="$baseline" --tolerance="$tolerance" \
+            -- "$converter" "${perf_opts[@]}"; then
+        fail "Performance regressed against the reference converter"
+    fi
+fi
+
+if (( failures )); then
+    error "$failures check(s) failed"
+    exit 1
+fi
+info "All checks passed"
@@ -0,0 +1,54 @@
+#!/usr/bin/bash
+
+# Writes the golden output of the regression checks with the reference converter, the
+# converter as it was before the optimizations of the conversion (tag pre-optimization,
+# override with REFERENCE_REVISION), so that tests/check.sh compares the current converter
+# with an independent reference rather than with its own earlier output. The reference
+# converter is built in obj/golden, and only rebuilt when the revision changes; check.sh
+# also times it for the performance gate. Needs ROOT and yaml-cpp, like the converter.
+#
+# Usage: tests/make_golden.sh <fixture filelist> <golden output>
+
+project_root="$( realpath "$(dirname -- "${BASH_SOURCE[0]}")/.." )"
+. "$project_root/scripts/util.sh"
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <fixture filelist> <golden output>"
+    exit 2
+fi
+filelist="$1"
+golden="$2"
+revision="${REFERENCE_REVISION:-pre-optimization}"
+config="$project_root/tests/config.yaml"
+work="$project_root/obj/golden"
+
+commit=$(git -C "$project_root" rev-parse --verify -q "$revision^{commit}")
+if [ -z "$commit" ]; then
+    error "Reference revision $revision not found; fetch the tags with git fetch --tags"
+    exit 1
+fi
+
+if [ "$(cat "$work/revision" 2>/dev/null)" != "$commit" ] || [ ! -x "$work/src/bin/converter" ]; then
+    rm -rf "$work"
+    mkdir -p "$work/src"
+    info "Building the reference converter of $revision"
+    if ! git -C "$project_root" archive "$commit" | tar -x -C "$work/src"; then
+        error "Revision $revision could not be checked out"
+        exit 1
+    fi
+    if ! make -C "$work/src" > "$work/build.log" 2>&1; then
+        error "Build of revision $revision failed, see $work/build.log"
+        exit 1
+    fi
+    echo "$commit" > "$work/revision"
+fi
+
+# the histograms and summaries of the current converter did not exist yet, so the golden
+# output only holds the tree, without them
+info "Converting the fixture with the reference converter"
+mkdir -p "$(dirname "$golden")"
+if ! "$work/src/bin/converter" -i "$filelist" -o "$golden" -c "$config" --save-clusters \
+        > "$work/converter.log" 2>&1; then
+    error "Conversion with revision $revision failed, see $work/converter.log"
+    exit 1
+fi
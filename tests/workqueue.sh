@@ -0,0 +1,57 @@
+#!/usr/bin/bash
+
+# Check of scripts/workqueue.py with several local worker processes draining a queue in a
+# temporary directory, run by tests/check.sh. Needs neither ROOT nor the converter: the
+# batches are "converted" by a shell command recording them. One worker is killed while
+# holding a lease, which the others must reclaim; one batch fails once and is retried,
+# and one always fails and must end up in failed/.
+
+project_root="$( realpath "$(dirname -- "${BASH_SOURCE[0]}")/.." )"
+. "$project_root/scripts/util.sh"
+
+workqueue=("python3" "$project_root/scripts/workqueue.py")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+queue="$work/queue"
+ttl=2
+
+seq -f "$work/AO2D_%02g.root" 1 20 > "$work/filelist.txt"
+"${workqueue[@]}" "$queue" init --filelist "$work/filelist.txt" --batch-size 3 || exit 1
+mkdir -p "$work/converted"
+
+# a worker that dies without releasing its lease
+setsid "${workqueue[@]}" "$queue" --ttl $ttl run -- sleep 60 > "$work/crashed.log" 2>&1 &
+crashed=$!
+while [ -z "$(ls "$queue/leases")" ]; do sleep 0.1; done
+kill -9 -- -$crashed
+info "Killed worker $crashed holding $(ls "$queue/leases")"
+
+convert='sleep 0.2
+case "$QUEUE_BATCH.$QUEUE_ATTEMPT" in
+    2.0|5.*) exit 1 ;;
+esac
+cat "$QUEUE_FILELIST" >> "$0/$QUEUE_BATCH"'
+pids=()
+for i in 1 2 3 4; do
+    "${workqueue[@]}" "$queue" --ttl $ttl --max-attempts 2 run --heartbeat 0.5 --wait -- \
+        bash -c "$convert" "$work/converted" > "$work/worker_$i.log" 2>&1 &
+    pids+=($!)
+done
+for pid in "${pids[@]}"; do wait "$pid"; done
+
+failures=0
+fail() { error "$*"; failures=$(( failures + 1 )); }
+
+[ -z "$(find "$queue/pending" "$queue/leases" -type f)" ] || fail "Batches left in pending/ or leases/"
+[ "$(ls "$queue/failed")" = "5" ] || fail "Expected only batch 5 in failed/, got: $(ls "$queue/failed")"
+[ "$(ls "$queue/done" | sort -n | xargs)" = "1 2 3 4 6 7" ] || fail "Unexpected batches in done/: $(ls "$queue/done" | xargs)"
+expected=$(sed -e '13,15d' "$work/filelist.txt")
+[ "$(cat "$work"/converted/* | sort)" = "$expected" ] || fail "Converted files differ from the queued ones"
+grep -q "Reclaimed batch 1" "$work"/worker_*.log || fail "The lease of the killed worker was not reclaimed"
+
+if (( failures )); then
+    "${workqueue[@]}" "$queue" status
+    cat "$work"/worker_*.log
+    exit 1
+fi
+info "Work queue drained by 4 workers, with a killed worker, a retried and a failed batch"
@@ -0,0 +1,183 @@
+// Scans the AO2Ds of a filelist in parallel and writes their catalog (see Catalog.hpp):
+// per DF, the entries and compressed size of the tables, the run numbers and whether it
+// is readable.
+//
+//   ao2dcatalog -i <filelist> -o <catalog.tsv> [--threads=<n>] [--deep] [-v]
+
+#include "Catalog.hpp"
+#include "logger.hpp"
+
+#include <TBranch.h>
+#include <TClass.h>
+#include <TFile.h>
+#include <TKey.h>
+#include <TLeaf.h>
+#include <TROOT.h>
+#include <TTree.h>
+
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+// read every entry of every branch, which decompresses all baskets
+bool readAll(TTree *tree) {
+  for (Long64_t i = 0, n = tree->GetEntries(); i < n; i++)
+    if (tree->GetEntry(i) < 0) return false;
+  return true;
+}
+
+// run numbers of the bcs of a DF, reading only that column; false if a basket is unreadable
+bool readRuns(TTree *bcs, std::vector<int> &runs) {
+  TBranch *branch = bcs->GetBranch("fRunNumber");
+  if (!branch) return true;
+  TLeaf *leaf = branch->GetLeaf("fRunNumber");
+  std::set<int> unique;
+  for (Long64_t i = 0, n = bcs->GetEntries(); i < n; i++) {
+    if (branch->GetEntry(i) < 0) return false;
+    unique.insert((int)leaf->GetValue());
+  }
+  runs.assign(unique.begin(), unique.end());
+  return true;
+}
+
+CatalogFile scanFile(const std::string &path, bool deep) {
+  CatalogFile entry;
+  entry.path = path;
+  std::error_code ec;
+  entry.bytes = std::filesystem::file_size(path, ec);
+  if (ec) {
+    entry.status = "missing";
+    entry.bytes = 0;
+    return entry;
+  }
+  std::unique_ptr<TFile> file(TFile::Open(path.c_str()));
+  if (!file || file->IsZombie()) {
+    entry.status = "zombie";
+    return entry;
+  }
+  if (file->TestBit(TFile::kRecovered)) entry.status = "recovered";
+
+  TIter next(file->GetListOfKeys());
+  TKey *key;
+  while ((key = (TKey *)next())) {
+    TClass *cl = TClass::GetClass(key->GetClassName());
+    if (!cl || !cl->InheritsFrom("TDirectory")) continue;
+    CatalogDF df;
+    df.name = key->GetName();
+    std::unique_ptr<TDirectory> dir((TDirectory *)key->ReadObj());
+    if (!dir) {
+      df.status = "unreadable";
+      entry.dfs.push_back(df);
+      continue;
+    }
+#define CATALOG_SCAN(member, name)                                  \
+    if (auto *tree = dynamic_cast<TTree *>(dir->Get(name))) {       \
+      df.counts.member = tree->GetEntries();                        \
+      df.bytes += tree->GetZipBytes();                              \
+      if (deep && !readAll(tree)) df.status = "unreadable";         \
+    }
+    CATALOG_TABLES_DO(CATALOG_SCAN)
+#undef CATALOG_SCAN
+    if (auto *bcs = dynamic_cast<TTree *>(dir->Get("O2jbc")))
+      if (!readRuns(bcs, df.runs)) df.status = "unreadable";
+    if (df.status == "ok" && !df.counts.complete(false)) df.status = "incomplete";
+    entry.dfs.push_back(df);
+  }
+  return entry;
+}
+
+void displayHelp() {
+  std::cout << "./ao2dcatalog [args]" << std::endl;
+  std::cout << "\t--input-filelist=<file>, -i <file> : text file with paths to AO2Ds" << std::endl;
+  std::cout << "\t--output=<file>, -o <file>         : catalog to write" << std::endl;
+  std::cout << "\t--threads=<n>                      : files scanned in parallel (default: number of cores)" << std::endl;
+  std::cout << "\t--deep                             : read every basket of every table to find corrupted files, instead of only the run numbers" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  setSeverity(Logger::Level::INFO);
+  std::string inputFilelist, output;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  bool deep = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value;
+    size_t eq = arg.find('=');
+    if (eq != std::string::npos) {
+      value = arg.substr(eq + 1);
+      arg = arg.substr(0, eq);
+    } else if ((arg == "-i" || arg == "--input-filelist" || arg == "-o" || arg == "--output" || arg == "--threads") &&
+               i + 1 < argc) {
+      value = argv[++i];
+    }
+    if (arg == "-i" || arg == "--input-filelist") {
+      inputFilelist = value;
+    } else if (arg == "-o" || arg == "--output") {
+      output = value;
+    } else if (arg == "--threads") {
+      threads = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--deep") {
+      deep = true;
+    } else if (arg.compare(0, 2, "-v") == 0) {
+      decreaseSeverity(std::count(arg.begin(), arg.end(), 'v'));
+    } else {
+      displayHelp();
+      return arg == "-h" || arg == "--help" ? 0 : 1;
+    }
+  }
+  if (inputFilelist.empty() || output.empty()) {
+    displayHelp();
+    return 1;
+  }
+
+  try {
+    std::ifstream list(inputFilelist);
+    if (!list.is_open()) throw std::runtime_error("Input file list " + inputFilelist + " could not be read");
+    std::vector<std::string> paths;
+    for (std::string line; std::getline(list, line);)
+      if (!line.empty()) paths.push_back(line);
+
+    // every thread opens its own files
+    ROOT::EnableThreadSafety();
+    threads = std::min<int>(threads, std::max<size_t>(1, paths.size()));
+    logInfo("Scanning ", paths.size(), " files with ", threads, " threads", deep ? ", reading every basket" : "");
+
+    std::vector<CatalogFile> entries(paths.size());
+    std::atomic<size_t> nextFile{0}, scanned{0};
+    std::mutex logMutex;
+    auto work = [&]() {
+      for (size_t i; (i = nextFile++) < paths.size();) {
+        entries[i] = scanFile(paths[i], deep);
+        size_t done = ++scanned;
+        std::lock_guard<std::mutex> lock(logMutex);
+        if (!entries[i].usable(false)) logWarning("   ", paths[i], ": ", entries[i].status);
+        if (done % 100 == 0) logInfo("   Scanned ", done, " of ", paths.size(), " files");
+      }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) pool.emplace_back(work);
+    for (auto &thread : pool) thread.join();
+
+    Catalog catalog;
+    long dfs = 0, badFiles = 0, badDFs = 0;
+    for (auto &entry : entries) {
+      dfs += entry.dfs.size();
+      if (!entry.usable(false)) badFiles++;
+      for (auto &df : entry.dfs)
+        if (!df.usable(false)) badDFs++;
+      catalog.add(std::move(entry));
+    }
+    catalog.write(output);
+    CatalogCounts totals = catalog.totals(false);
+    logInfo("Catalog written to ", output, ": ", paths.size(), " files, ", dfs, " DFs, ", totals.collisions,
+            " collisions; ", badFiles, " unusable files, ", badDFs, " unusable DFs");
+  } catch (const std::exception &e) {
+    logError(e.what());
+    return 1;
+  }
+  return 0;
+}
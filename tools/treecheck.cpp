@@ -0,0 +1,698 @@
+// Regression checks of converter outputs, see tests/check.sh (make check).
+//
+//   treecheck summary <output>                       per-branch statistics and checksums
+//   treecheck compare <reference> <output>           compare two outputs within tolerances
+//   treecheck make-fixture <AO2D>                    write a synthetic AO2D to convert
+//   treecheck perf --input <AO2D> --baseline <file> -- <command>
+//                                                    time a conversion against a baseline,
+//                                                    or store it as the baseline with --update
+//
+// An output is a BerkeleyTree file, or a text file listing several (e.g. the run shards
+// and the histogram file of a sharded job), which are then summarized together.
+
+#include "logger.hpp"
+
+#include <TBranch.h>
+#include <TClass.h>
+#include <TFile.h>
+#include <TH1.h>
+#include <TKey.h>
+#include <TLeaf.h>
+#include <TRandom3.h>
+#include <TTree.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <yaml-cpp/yaml.h>
+
+// ---------------------------------------------------------------------------------------
+// reading branches
+
+// reads the values of one branch for the current entry as doubles, whatever its type and
+// whether it is a std::vector or a counted array, so both output layouts compare equal
+class Column {
+public:
+  virtual ~Column() = default;
+  virtual void values(std::vector<double> &out) = 0;
+};
+
+template<class T>
+class VectorColumn : public Column {
+  std::vector<T> *data = nullptr;
+
+public:
+  VectorColumn(TTree *tree, const char *name) { tree->SetBranchAddress(name, &data); }
+  ~VectorColumn() { delete data; }
+  void values(std::vector<double> &out) override { out.assign(data->begin(), data->end()); }
+};
+
+// scalars and leaf-list arrays, read through the buffer of their leaf
+class LeafColumn : public Column {
+  TLeaf *leaf;
+
+public:
+  explicit LeafColumn(TLeaf *leaf) : leaf(leaf) {}
+  void values(std::vector<double> &out) override {
+    out.resize(leaf->GetLen());
+    for (size_t i = 0; i < out.size(); i++) out[i] = leaf->GetValue(i);
+  }
+};
+
+std::unique_ptr<Column> makeColumn(TTree *tree, TBranch *branch) {
+  std::string cls = branch->GetClassName();
+  const char *name = branch->GetName();
+  if (cls.empty()) {
+    if (branch->GetListOfLeaves()->GetEntries() != 1)
+      throw std::runtime_error(std::string("Branch ") + name + " has more than one leaf");
+    return std::make_unique<LeafColumn>((TLeaf *)branch->GetListOfLeaves()->At(0));
+  }
+  if (cls == "vector<float>") return std::make_unique<VectorColumn<Float_t>>(tree, name);
+  if (cls == "vector<double>") return std::make_unique<VectorColumn<Double_t>>(tree, name);
+  if (cls == "vector<int>") return std::make_unique<VectorColumn<Int_t>>(tree, name);
+  if (cls == "vector<unsigned int>") return std::make_unique<VectorColumn<UInt_t>>(tree, name);
+  if (cls == "vector<short>") return std::make_unique<VectorColumn<Short_t>>(tree, name);
+  if (cls == "vector<unsigned short>") return std::make_unique<VectorColumn<UShort_t>>(tree, name);
+  if (cls == "vector<unsigned char>") return std::make_unique<VectorColumn<UChar_t>>(tree, name);
+  if (cls == "vector<char>") return std::make_unique<VectorColumn<Char_t>>(tree, name);
+  if (cls == "vector<bool>") return std::make_unique<VectorColumn<bool>>(tree, name);
+  if (cls == "vector<Long64_t>" || cls == "vector<long long>") return std::make_unique<VectorColumn<Long64_t>>(tree, name);
+  if (cls == "vector<ULong64_t>" || cls == "vector<unsigned long long>")
+    return std::make_unique<VectorColumn<ULong64_t>>(tree, name);
+  throw std::runtime_error(std::string("Branch ") + name + " has the unsupported type " + cls);
+}
+
+// ---------------------------------------------------------------------------------------
+// summaries
+
+uint64_t mix(uint64_t x) {
+  // splitmix64 finalizer
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+uint64_t bits(double v) {
+  if (std::isnan(v)) v = NAN; // one NaN
+  if (v == 0) v = 0;          // and one zero
+  uint64_t b;
+  std::memcpy(&b, &v, sizeof b);
+  return b;
+}
+
+// Statistics of all values of a branch. The checksum is the sum of a hash of the values of
+// every entry, so it depends on the content of each event but not on the order of events,
+// which threading and run sharding are free to change.
+struct BranchSummary {
+  long entries = 0;
+  long values = 0;
+  long nans = 0;
+  double sum = 0, sum2 = 0;
+  double min = INFINITY, max = -INFINITY;
+  uint64_t checksum = 0;
+
+  void add(const std::vector<double> &vals) {
+    uint64_t hash = mix(vals.size());
+    for (double v : vals) {
+      hash = mix(hash ^ bits(v));
+      if (std::isnan(v)) {
+        nans++;
+        continue;
+      }
+      sum += v;
+      sum2 += v * v;
+      min = std::min(min, v);
+      max = std::max(max, v);
+    }
+    values += vals.size();
+    entries++;
+    checksum += mix(hash);
+  }
+
+  double mean() const { return values > nans ? sum / (values - nans) : 0; }
+  double rms() const { return values > nans ? std::sqrt(std::max(0., sum2 / (values - nans) - mean() * mean())) : 0; }
+};
+
+struct OutputSummary {
+  long entries = 0;
+  std::map<std::string, BranchSummary> branches;
+  std::map<std::string, std::unique_ptr<TH1>> histograms;
+};
+
+std::vector<std::string> expandInputs(const std::string &path) {
+  if (path.size() > 5 && path.compare(path.size() - 5, 5, ".root") == 0) return {path};
+  std::ifstream list(path);
+  if (!list.is_open()) throw std::runtime_error("File list " + path + " could not be read");
+  std::vector<std::string> files;
+  std::string line;
+  while (std::getline(list, line))
+    if (!line.empty()) files.push_back(line);
+  return files;
+}
+
+void summarizeTree(TTree *tree, OutputSummary &summary) {
+  std::vector<std::pair<std::string, std::unique_ptr<Column>>> columns;
+  for (auto *obj : *tree->GetListOfBranches()) {
+    auto *branch = (TBranch *)obj;
+    columns.emplace_back(branch->GetName(), makeColumn(tree, branch));
+  }
+  std::vector<double> vals;
+  for (Long64_t i = 0, n = tree->GetEntries(); i < n; i++) {
+    tree->GetEntry(i);
+    for (auto &[name, column] : columns) {
+      column->values(vals);
+      summary.branches[name].add(vals);
+    }
+  }
+  summary.entries += tree->GetEntries();
+  // the columns own the vectors the tree points to
+  tree->ResetBranchAddresses();
+}
+
+// histograms of the same name in several files are added up
+void collectHistograms(TFile &file, OutputSummary &summary) {
+  std::set<std::string> seen;
+  for (auto *obj : *file.GetListOfKeys()) {
+    auto *key = (TKey *)obj;
+    // keys are sorted by cycle, the first one of a name is the latest
+    if (!seen.insert(key->GetName()).second) continue;
+    TClass *cl = TClass::GetClass(key->GetClassName());
+    if (!cl || !cl->InheritsFrom(TH1::Class())) continue;
+    auto *hist = (TH1 *)key->ReadObj();
+    hist->SetDirectory(nullptr);
+    auto &slot = summary.histograms[hist->GetName()];
+    if (slot) {
+      slot->Add(hist);
+      delete hist;
+    } else {
+      slot.reset(hist);
+    }
+  }
+}
+
+OutputSummary summarize(const std::string &path, const std::string &treeName) {
+  OutputSummary summary;
+  for (auto &filename : expandInputs(path)) {
+    std::unique_ptr<TFile> file(TFile::Open(filename.c_str()));
+    if (!file || file->IsZombie()) throw std::runtime_error("File " + filename + " could not be opened");
+    if (auto *tree = dynamic_cast<TTree *>(file->Get(treeName.c_str()))) summarizeTree(tree, summary);
+    collectHistograms(*file, summary);
+  }
+  return summary;
+}
+
+std::string hex(uint64_t x) {
+  std::ostringstream ss;
+  ss << std::hex << std::setw(16) << std::setfill('0') << x;
+  return ss.str();
+}
+
+void printSummary(const OutputSummary &summary) {
+  std::cout << "entries: " << summary.entries << "\n";
+  std::cout << std::left << std::setw(34) << "branch" << std::right << std::setw(10) << "values" << std::setw(14) << "mean"
+            << std::setw(14) << "rms" << std::setw(14) << "min" << std::setw(14) << "max" << "  checksum\n";
+  for (auto &[name, b] : summary.branches)
+    std::cout << std::left << std::setw(34) << name << std::right << std::setw(10) << b.values << std::setw(14) << b.mean()
+              << std::setw(14) << b.rms() << std::setw(14) << b.min << std::setw(14) << b.max << "  " << hex(b.checksum)
+              << "\n";
+  for (auto &[name, h] : summary.histograms)
+    std::cout << "histogram " << name << ": " << h->GetEntries() << " entries, integral " << h->Integral() << "\n";
+}
+
+// ---------------------------------------------------------------------------------------
+// comparison
+
+struct Tolerance {
+  double rel = 1e-6;
+  double abs = 1e-9;
+  bool close(double a, double b) const {
+    if (std::isnan(a) || std::isnan(b)) return std::isnan(a) && std::isnan(b);
+    if (std::isinf(a) || std::isinf(b)) return a == b;
+    return std::fabs(a - b) <= abs + rel * std::max(std::fabs(a), std::fabs(b));
+  }
+};
+
+// returns the number of differences beyond the tolerance
+int compareSummaries(const OutputSummary &ref, const OutputSummary &out, const Tolerance &tol,
+                     const std::set<std::string> &ignore, bool exact, bool histograms) {
+  int failures = 0;
+  auto fail = [&](auto &&...args) {
+    logError(args...);
+    failures++;
+  };
+
+  if (ref.entries != out.entries) fail("Entries differ: ", ref.entries, " in the reference, ", out.entries, " now");
+
+  for (auto &[name, r] : ref.branches) {
+    if (ignore.count(name)) continue;
+    auto it = out.branches.find(name);
+    if (it == out.branches.end()) {
+      fail("Branch ", name, " is missing");
+      continue;
+    }
+    const BranchSummary &o = it->second;
+    if (r.values != o.values) fail("Branch ", name, ": ", r.values, " values in the reference, ", o.values, " now");
+    if (r.nans != o.nans) fail("Branch ", name, ": ", r.nans, " NaNs in the reference, ", o.nans, " now");
+    std::pair<const char *, std::pair<double, double>> stats[] = {
+        {"sum", {r.sum, o.sum}}, {"rms", {r.rms(), o.rms()}}, {"min", {r.min, o.min}}, {"max", {r.max, o.max}}};
+    bool statsClose = true;
+    for (auto &[stat, values] : stats) {
+      if (!tol.close(values.first, values.second)) {
+        fail("Branch ", name, ": ", stat, " is ", values.first, " in the reference, ", values.second, " now");
+        statsClose = false;
+      }
+    }
+    if (r.checksum != o.checksum && statsClose) {
+      if (exact)
+        fail("Branch ", name, ": checksums differ");
+      else
+        logWarning("Branch ", name, ": content differs within the tolerance");
+    }
+  }
+  for (auto &[name, o] : out.branches)
+    if (!ignore.count(name) && !ref.branches.count(name)) fail("Branch ", name, " is new");
+
+  if (!histograms) return failures;
+  for (auto &[name, r] : ref.histograms) {
+    auto it = out.histograms.find(name);
+    if (it == out.histograms.end()) {
+      fail("Histogram ", name, " is missing");
+      continue;
+    }
+    TH1 *o = it->second.get();
+    if (r->GetNcells() != o->GetNcells() || r->GetDimension() != o->GetDimension()) {
+      fail("Histogram ", name, ": binning differs");
+      continue;
+    }
+    if (!tol.close(r->GetEntries(), o->GetEntries()))
+      fail("Histogram ", name, ": ", r->GetEntries(), " entries in the reference, ", o->GetEntries(), " now");
+    int differing = 0, worst = -1;
+    double worstDiff = 0;
+    for (int bin = 0; bin < r->GetNcells(); bin++) {
+      double a = r->GetBinContent(bin), b = o->GetBinContent(bin);
+      if (tol.close(a, b)) continue;
+      differing++;
+      if (std::fabs(a - b) > worstDiff) {
+        worstDiff = std::fabs(a - b);
+        worst = bin;
+      }
+    }
+    if (differing)
+      fail("Histogram ", name, ": ", differing, " bins differ, most in bin ", worst, " (", r->GetBinContent(worst),
+           " in the reference, ", o->GetBinContent(worst), " now)");
+  }
+  for (auto &[name, o] : out.histograms)
+    if (!ref.histograms.count(name)) fail("Histogram ", name, " is new");
+
+  return failures;
+}
+
+// ---------------------------------------------------------------------------------------
+// fixture
+
+// Synthetic AO2D with the tables and columns read by the converter. The content is fixed
+// by the seed, so the conversion of a fixture can be compared with a stored reference.
+void makeFixture(const std::string &filename, int dataframes, int collisions, UInt_t seed) {
+  TRandom3 rng(seed);
+  TFile file(filename.c_str(), "RECREATE");
+  if (file.IsZombie()) throw std::runtime_error("Fixture " + filename + " could not be created");
+  const Int_t runs[] = {544122, 544123, 545210};
+
+  for (int df = 0; df < dataframes; df++) {
+    TDirectory *dir = file.mkdir(("DF_" + std::to_string(1000 + df)).c_str());
+    dir->cd();
+
+    // one bc per collision, a DF usually holds a single run
+    Int_t runNumber = runs[df % 3];
+    TTree bc("O2jbc", "O2jbc");
+    bc.Branch("fRunNumber", &runNumber, "fRunNumber/I");
+
+    Int_t idxBC, occupancy;
+    Float_t posX, posY, posZ, mult, cent;
+    UShort_t eventSel;
+    ULong64_t triggerSel;
+    UInt_t rct;
+    TTree col("O2jcollision", "O2jcollision");
+    col.Branch("fIndexJBCs", &idxBC, "fIndexJBCs/I");
+    col.Branch("fPosX", &posX, "fPosX/F");
+    col.Branch("fPosY", &posY, "fPosY/F");
+    col.Branch("fPosZ", &posZ, "fPosZ/F");
+    col.Branch("fMultFT0C", &mult, "fMultFT0C/F");
+    col.Branch("fCentFT0C", &cent, "fCentFT0C/F");
+    col.Branch("fTrackOccupancyInTimeRange", &occupancy, "fTrackOccupancyInTimeRange/I");
+    col.Branch("fEventSel", &eventSel, "fEventSel/s");
+    col.Branch("fTriggerSel", &triggerSel, "fTriggerSel/l");
+    col.Branch("fRct", &rct, "fRct/i");
+
+    Int_t trackCol;
+    Float_t pt, eta, phi;
+    UChar_t trackSel;
+    TTree track("O2jtrack", "O2jtrack");
+    track.Branch("fIndexJCollisions", &trackCol, "fIndexJCollisions/I");
+    track.Branch("fPt", &pt, "fPt/F");
+    track.Branch("fEta", &eta, "fEta/F");
+    track.Branch("fPhi", &phi, "fPhi/F");
+    track.Branch("fTrackSel", &trackSel, "fTrackSel/b");
+
+    Int_t clusterCol, ncells, nlm, definition, leadNumber, subleadNumber;
+    Float_t energy, coreEnergy, rawEnergy, clEta, clPhi, m02, m20, time, dbc, leadEnergy, subleadEnergy;
+    Bool_t exotic;
+    TTree cluster("O2jcluster", "O2jcluster");
+    cluster.Branch("fIndexJCollisions", &clusterCol, "fIndexJCollisions/I");
+    cluster.Branch("fEnergy", &energy, "fEnergy/F");
+    cluster.Branch("fCoreEnergy", &coreEnergy, "fCoreEnergy/F");
+    cluster.Branch("fRawEnergy", &rawEnergy, "fRawEnergy/F");
+    cluster.Branch("fEta", &clEta, "fEta/F");
+    cluster.Branch("fPhi", &clPhi, "fPhi/F");
+    cluster.Branch("fM02", &m02, "fM02/F");
+    cluster.Branch("fM20", &m20, "fM20/F");
+    cluster.Branch("fNCells", &ncells, "fNCells/I");
+    cluster.Branch("fTime", &time, "fTime/F");
+    cluster.Branch("fIsExotic", &exotic, "fIsExotic/O");
+    cluster.Branch("fDistanceToBadChannel", &dbc, "fDistanceToBadChannel/F");
+    cluster.Branch("fNLM", &nlm, "fNLM/I");
+    cluster.Branch("fDefinition", &definition, "fDefinition/I");
+    cluster.Branch("fLeadingCellEnergy", &leadEnergy, "fLeadingCellEnergy/F");
+    cluster.Branch("fSubleadingCellEnergy", &subleadEnergy, "fSubleadingCellEnergy/F");
+    cluster.Branch("fLeadingCellNumber", &leadNumber, "fLeadingCellNumber/I");
+    cluster.Branch("fSubleadingCellNumber", &subleadNumber, "fSubleadingCellNumber/I");
+
+    Int_t nMatched, matched[4];
+    TTree clustertrack("O2jclustertrack", "O2jclustertrack");
+    clustertrack.Branch("fSizeIndexArrayJTracks", &nMatched, "fSizeIndexArrayJTracks/I");
+    clustertrack.Branch("fIndexArrayJTracks", matched, "fIndexArrayJTracks[fSizeIndexArrayJTracks]/I");
+
+    Int_t emcTrack;
+    Float_t etaEMCAL, phiEMCAL, etaDiff, phiDiff;
+    TTree emctrack("O2jemctrack", "O2jemctrack");
+    emctrack.Branch("fIndexJTracks", &emcTrack, "fIndexJTracks/I");
+    emctrack.Branch("fEtaEMCAL", &etaEMCAL, "fEtaEMCAL/F");
+    emctrack.Branch("fPhiEMCAL", &phiEMCAL, "fPhiEMCAL/F");
+    emctrack.Branch("fEtaDiff", &etaDiff, "fEtaDiff/F");
+    emctrack.Branch("fPhiDiff", &phiDiff, "fPhiDiff/F");
+
+    Int_t nTracks = 0;
+    std::set<Int_t> emcTracks;
+    for (Int_t c = 0; c < collisions; c++) {
+      idxBC = c;
+      bc.Fill();
+      posX = rng.Gaus(0, 0.05);
+      posY = rng.Gaus(0, 0.05);
+      posZ = rng.Gaus(0, 8); // some outside the usual 10 cm cut
+      cent = rng.Uniform(0, 100);
+      mult = rng.Poisson(30 + 3 * (100 - cent));
+      occupancy = rng.Integer(5000);
+      eventSel = rng.Integer(1 << 16);
+      triggerSel = ((ULong64_t)rng.Integer(1u << 31) << 32) | rng.Integer(1u << 31);
+      rct = rng.Integer(1u << 31);
+      col.Fill();
+
+      // tracks not assigned to any collision sit between those of the collisions
+      for (int t = rng.Poisson(0.3); t > 0; t--, nTracks++) {
+        trackCol = -1;
+        pt = rng.Exp(1.);
+        eta = rng.Uniform(-0.9, 0.9);
+        phi = rng.Uniform(0, 2 * M_PI);
+        trackSel = rng.Integer(256);
+        track.Fill();
+      }
+
+      Int_t firstTrack = nTracks;
+      for (int t = rng.Poisson(12); t > 0; t--, nTracks++) {
+        trackCol = c;
+        pt = rng.Exp(1.);
+        eta = rng.Uniform(-0.9, 0.9);
+        phi = rng.Uniform(0, 2 * M_PI);
+        trackSel = rng.Integer(256);
+        track.Fill();
+      }
+
+      for (int k = rng.Poisson(4); k > 0; k--) {
+        // some clusters are not assigned to any collision either
+        clusterCol = rng.Rndm() < 0.05 ? -1 : c;
+        energy = rng.Exp(2.);
+        coreEnergy = 0.9 * energy;
+        rawEnergy = 1.05 * energy;
+        clEta = rng.Uniform(-0.7, 0.7);
+        clPhi = rng.Uniform(1.4, 3.3);
+        m02 = rng.Uniform(0.1, 2);
+        m20 = rng.Uniform(0.1, m02);
+        ncells = 1 + rng.Poisson(4);
+        time = rng.Gaus(0, 20);
+        exotic = rng.Rndm() < 0.05;
+        dbc = rng.Uniform(0, 10);
+        nlm = 1 + rng.Integer(3);
+        definition = rng.Rndm() < 0.8 ? 10 : 0;
+        leadEnergy = 0.6 * energy;
+        subleadEnergy = 0.2 * energy;
+        leadNumber = rng.Integer(17664);
+        subleadNumber = rng.Integer(17664);
+        cluster.Fill();
+
+        // matched tracks are mostly among the tracks of the same collision, sometimes one of
+        // an earlier collision or an unassigned one
+        nMatched = 0;
+        Int_t available = nTracks - firstTrack;
+        for (int m = std::min<Int_t>(available, rng.Integer(3)); m > 0; m--) {
+          Int_t idx = firstTrack + rng.Integer(available);
+          if (std::find(matched, matched + nMatched, idx) != matched + nMatched) continue;
+          matched[nMatched++] = idx;
+          emcTracks.insert(idx);
+        }
+        if (firstTrack > 0 && nMatched < 4 && rng.Rndm() < 0.1) {
+          Int_t idx = rng.Integer(firstTrack);
+          matched[nMatched++] = idx;
+          emcTracks.insert(idx);
+        }
+        clustertrack.Fill();
+      }
+    }
+    for (Int_t idx : emcTracks) {
+      emcTrack = idx;
+      etaEMCAL = rng.Uniform(-0.7, 0.7);
+      phiEMCAL = rng.Uniform(1.4, 3.3);
+      etaDiff = rng.Gaus(0, 0.01);
+      phiDiff = rng.Gaus(0, 0.01);
+      emctrack.Fill();
+    }
+
+    for (TTree *tree : {&bc, &col, &track, &cluster, &clustertrack, &emctrack}) tree->Write();
+    for (TTree *tree : {&bc, &col, &track, &cluster, &clustertrack, &emctrack}) tree->SetDirectory(nullptr);
+  }
+  file.Close();
+  logInfo("Fixture written to ", filename, ": ", dataframes, " DFs of ", collisions, " collisions");
+}
+
+// ---------------------------------------------------------------------------------------
+// performance
+
+// collisions in the O2jcollision tables of all DFs of the input
+long countCollisions(const std::string &path) {
+  long count = 0;
+  for (auto &filename : expandInputs(path)) {
+    std::unique_ptr<TFile> file(TFile::Open(filename.c_str()));
+    if (!file || file->IsZombie()) throw std::runtime_error("File " + filename + " could not be opened");
+    for (auto *obj : *file->GetListOfKeys()) {
+      auto *dir = dynamic_cast<TDirectory *>(((TKey *)obj)->ReadObj());
+      if (!dir) continue;
+      if (auto *tree = dynamic_cast<TTree *>(dir->Get("O2jcollision"))) count += tree->GetEntries();
+    }
+  }
+  return count;
+}
+
+struct RunResult {
+  double seconds;
+  long peakRSSkB;
+};
+
+// run the command and measure its wall time and peak resident memory
+RunResult runCommand(const std::vector<std::string> &command) {
+  std::vector<char *> argv;
+  for (auto &arg : command) argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) throw std::runtime_error("fork failed");
+  if (pid == 0) {
+    // only the errors of the command are shown
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) dup2(devnull, STDOUT_FILENO);
+    execvp(argv[0], argv.data());
+    std::perror(argv[0]);
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) throw std::runtime_error("wait4 failed");
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    throw std::runtime_error("Command " + command[0] + " failed with status " + std::to_string(status));
+  return {seconds, usage.ru_maxrss};
+}
+
+// returns 0 if neither the throughput nor the peak memory regressed beyond the tolerance
+int perfGate(const std::string &input, const std::string &baselineFile, double tolerance, int repeat, bool update,
+             const std::vector<std::string> &command) {
+  long collisions = countCollisions(input);
+  if (!collisions) throw std::runtime_error("No collisions in " + input);
+
+  // best of a few runs, to be robust against a busy machine
+  double seconds = INFINITY;
+  long peakRSSkB = 0;
+  for (int i = 0; i < repeat; i++) {
+    RunResult r = runCommand(command);
+    logInfo("Run ", i + 1, ": ", r.seconds, " s, peak RSS ", r.peakRSSkB / 1024., " MB");
+    seconds = std::min(seconds, r.seconds);
+    peakRSSkB = std::max(peakRSSkB, r.peakRSSkB);
+  }
+  double throughput = collisions / seconds;
+  double peakMB = peakRSSkB / 1024.;
+  logInfo("Throughput: ", throughput, " collisions/s, peak RSS: ", peakMB, " MB");
+
+  if (update) {
+    YAML::Node baseline;
+    baseline["collisions_per_second"] = throughput;
+    baseline["peak_rss_mb"] = peakMB;
+    baseline["collisions"] = collisions;
+    char date[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof date, "%Y-%m-%d", std::localtime(&now));
+    baseline["date"] = date;
+    std::ofstream(baselineFile) << baseline << "\n";
+    logInfo("Stored the baseline in ", baselineFile);
+    return 0;
+  }
+  if (!std::ifstream(baselineFile).good())
+    throw std::runtime_error("No baseline " + baselineFile + ", write it with --update");
+
+  YAML::Node baseline = YAML::LoadFile(baselineFile);
+  double baseThroughput = baseline["collisions_per_second"].as<double>();
+  double basePeakMB = baseline["peak_rss_mb"].as<double>();
+  int failures = 0;
+  if (throughput < baseThroughput * (1 - tolerance)) {
+    logError("Throughput regressed: ", throughput, " collisions/s against ", baseThroughput, " in the baseline");
+    failures++;
+  }
+  if (peakMB > basePeakMB * (1 + tolerance)) {
+    logError("Peak memory regressed: ", peakMB, " MB against ", basePeakMB, " MB in the baseline");
+    failures++;
+  }
+  if (!failures) {
+    logInfo("Within ", 100 * tolerance, "% of the baseline (", baseThroughput, " collisions/s, ", basePeakMB, " MB)");
+    if (throughput > baseThroughput * (1 + tolerance) || peakMB < basePeakMB * (1 - tolerance))
+      logInfo("Clearly better than the baseline");
+  }
+  return failures ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------------------
+
+void usage() {
+  std::cout << "treecheck <command> [args]" << std::endl;
+  std::cout << "\tsummary <output> [--tree=<name>]" << std::endl;
+  std::cout << "\t\tPer-branch statistics and order-independent checksums, and the histograms" << std::endl;
+  std::cout << "\tcompare <reference> <output> [--rel-tol=<x>] [--abs-tol=<x>] [--ignore=<b1,b2,...>] [--exact] [--no-histograms] [--tree=<name>]" << std::endl;
+  std::cout << "\t\tCompare the branches and histograms of two outputs (default tolerances: 1e-6 relative, 1e-9 absolute)" << std::endl;
+  std::cout << "\tmake-fixture <AO2D> [--dataframes=<n>] [--collisions=<n>] [--seed=<n>]" << std::endl;
+  std::cout << "\t\tWrite a synthetic AO2D (default: 4 DFs of 500 collisions, seed 1)" << std::endl;
+  std::cout << "\tperf --input=<AO2D or list> --baseline=<file> [--tolerance=<x>] [--repeat=<n>] [--update] -- <command>" << std::endl;
+  std::cout << "\t\tRun a conversion and fail if its throughput or peak RSS regressed beyond the tolerance (default: 0.2)," << std::endl;
+  std::cout << "\t\tor store its throughput and peak RSS as the baseline with --update" << std::endl;
+  std::cout << "\tAn output is a ROOT file or a text file listing several." << std::endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  // the results are logged at INFO level
+  setSeverity(Logger::Level::INFO);
+  std::string command = argv[1];
+  std::vector<std::string> positional, passthrough;
+  std::map<std::string, std::string> options;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      passthrough.assign(argv + i + 1, argv + argc);
+      break;
+    }
+    if (arg.compare(0, 2, "--") == 0) {
+      size_t eq = arg.find('=');
+      options[arg.substr(2, eq == std::string::npos ? eq : eq - 2)] = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    } else if (arg.compare(0, 2, "-v") == 0) {
+      decreaseSeverity(std::count(arg.begin(), arg.end(), 'v'));
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  auto option = [&](const std::string &name, const std::string &fallback) {
+    auto it = options.find(name);
+    return it == options.end() ? fallback : it->second;
+  };
+
+  try {
+    std::string tree = option("tree", "eventTree");
+    if (command == "summary" && positional.size() == 1) {
+      printSummary(summarize(positional[0], tree));
+      return 0;
+    }
+    if (command == "compare" && positional.size() == 2) {
+      Tolerance tol;
+      tol.rel = std::stod(option("rel-tol", "1e-6"));
+      tol.abs = std::stod(option("abs-tol", "1e-9"));
+      std::set<std::string> ignore;
+      std::stringstream ss(option("ignore", ""));
+      for (std::string name; std::getline(ss, name, ',');)
+        if (!name.empty()) ignore.insert(name);
+      OutputSummary ref = summarize(positional[0], tree);
+      OutputSummary out = summarize(positional[1], tree);
+      int failures = compareSummaries(ref, out, tol, ignore, options.count("exact"), !options.count("no-histograms"));
+      if (failures) {
+        logError(positional[1], " differs from ", positional[0], " in ", failures, " places");
+        return 1;
+      }
+      logInfo(positional[1], " matches ", positional[0], ": ", out.entries, " entries, ", out.branches.size(),
+              " branches, ", out.histograms.size(), " histograms");
+      return 0;
+    }
+    if (command == "make-fixture" && positional.size() == 1) {
+      makeFixture(positional[0], std::stoi(option("dataframes", "4")), std::stoi(option("collisions", "500")),
+                  std::stoul(option("seed", "1")));
+      return 0;
+    }
+    if (command == "perf" && positional.empty() && !passthrough.empty() && options.count("input") &&
+        options.count("baseline")) {
+      return perfGate(options["input"], options["baseline"], std::stod(option("tolerance", "0.2")),
+                      std::stoi(option("repeat", "3")), options.count("update"), passthrough);
+    }
+  } catch (const std::exception &e) {
+    logError(e.what());
+    return 2;
+  }
+  usage();
+  return 2;
+}